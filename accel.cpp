@@ -1,6 +1,10 @@
 #include "accel.h"
 #include <windows.h>
 #include <algorithm>
+#include <limits>
+#ifdef RASTER_SSE2
+#include <emmintrin.h>
+#endif
 
 // #define _DEBUG
 
@@ -12,70 +16,284 @@ Accel::~Accel() {
     Clear();
 }
 
-void Accel::Split(KDNode *node, int depth) {
-    m_MaxDepth = std::max(m_MaxDepth, depth);
-    int nface = node->tris.size();
-    if (nface <= m_SplitTermination) {
+// 桶内三角形的数目和包围盒
+struct SAHBin {
+    int count = 0;
+    vec3 minPoint = vec3(MAX, MAX, MAX);
+    vec3 maxPoint = vec3(MIN, MIN, MIN);
+
+    void Expand(const vec3& minVert, const vec3& maxVert) {
+        for (int j = 0; j < 3; ++j) {
+            minPoint[j] = std::min(minPoint[j], minVert[j]);
+            maxPoint[j] = std::max(maxPoint[j], maxVert[j]);
+        }
+    }
+    void Merge(const SAHBin& other) {
+        count += other.count;
+        Expand(other.minPoint, other.maxPoint);
+    }
+    float SurfaceArea() const {
+        return count > 0 ? BoundingBox3f(minPoint, maxPoint).SurfaceArea() : 0.f;
+    }
+};
+
+struct SAHBins {
+    SAHBin bins[3][Accel::MAX_BIN_COUNT];
+};
+
+// 把[0, count)分成PARALLEL_CHUNK_SIZE大小的若干段 各段作为task并行执行func(段序号, begin, end)
+// 只有一段时直接在当前线程执行 需要在OpenMP的parallel区域中调用才会真正并行
+template<class Func>
+static void ForEachChunk(int count, Func func) {
+    int chunkCount = (count + Accel::PARALLEL_CHUNK_SIZE - 1) / Accel::PARALLEL_CHUNK_SIZE;
+    if (chunkCount <= 1) {
+        func(0, 0, count);
         return;
     }
+    for (int c = 0; c < chunkCount; ++c) {
+        int begin = c * Accel::PARALLEL_CHUNK_SIZE, end = std::min(begin + Accel::PARALLEL_CHUNK_SIZE, count);
+#pragma omp task firstprivate(c, begin, end) shared(func)
+        func(c, begin, end);
+    }
+#pragma omp taskwait
+}
 
-    const BoundingBox3f& box = node->boundingBox;
-    float dx = box.maxPoint.x - box.minPoint.x;
-    float dy = box.maxPoint.y - box.minPoint.y;
-    float dz = box.maxPoint.z - box.minPoint.z;
+static int ChunkCount(int count) {
+    return std::max(1, (count + Accel::PARALLEL_CHUNK_SIZE - 1) / Accel::PARALLEL_CHUNK_SIZE);
+}
 
-    // 沿着包围盒轴最长进行划分
-    if (dx > dy && dx > dz) {
-        std::sort(node->tris.begin(), node->tris.end(), [this](const int &l, const int &r) {
-            return this->m_Mesh->GetBoundingBox(l).GetCenter().x < this->m_Mesh->GetBoundingBox(r).GetCenter().x;
-        });
+void Accel::Split(BuildNode* node, int depth) {
+    int nface = node->triCount;
+    if (nface <= m_Config.minLeafSize || depth >= MAX_STACK_DEPTH) {
+        return;
     }
-    else if (dy > dz) {
-        std::sort(node->tris.begin(), node->tris.end(), [this](const int &l, const int &r) {
-            return this->m_Mesh->GetBoundingBox(l).GetCenter().y < this->m_Mesh->GetBoundingBox(r).GetCenter().y;
-        });
+    int* tris = &m_TriIndices[node->triOffset];
+
+    // 按三角形中心的包围盒分桶 包围盒大但中心集中的节点也能分开
+    // 上层的大节点分段并行统计 每段的结果最后合并
+    int chunkCount = ChunkCount(nface);
+    std::vector<SAHBin> chunkCentroids(chunkCount);
+    ForEachChunk(nface, [&](int c, int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            const vec3& centroid = m_Centroids[tris[i]];
+            chunkCentroids[c].Expand(centroid, centroid);
+        }
+    });
+    SAHBin centroidBox;
+    for (int c = 0; c < chunkCount; ++c) {
+        centroidBox.Merge(chunkCentroids[c]);
     }
-    else {
-        std::sort(node->tris.begin(), node->tris.end(), [this](const int &l, const int &r) {
-            return this->m_Mesh->GetBoundingBox(l).GetCenter().z < this->m_Mesh->GetBoundingBox(r).GetCenter().z;
-        });
+
+    // 一次遍历同时分好三个轴的桶 代价都乘上了节点面积 避免除以扁平节点的面积0
+    int binCount = std::max(2, std::min(m_Config.binCount, MAX_BIN_COUNT));
+    float nodeArea = node->boundingBox.SurfaceArea();
+    float scale[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        float extent = centroidBox.maxPoint[axis] - centroidBox.minPoint[axis];
+        scale[axis] = extent > 0.f ? binCount / extent : 0.f;
+    }
+    std::vector<SAHBins> chunkBins(chunkCount);
+    ForEachChunk(nface, [&](int c, int begin, int end) {
+        SAHBin (*bins)[MAX_BIN_COUNT] = chunkBins[c].bins;
+        for (int i = begin; i < end; ++i) {
+            int tri = tris[i];
+            const BoundingBox3f& box = m_TriBoxes[tri];
+            for (int axis = 0; axis < 3; ++axis) {
+                int b = std::min(binCount - 1, (int)((m_Centroids[tri][axis] - centroidBox.minPoint[axis]) * scale[axis]));
+                bins[axis][b].count++;
+                bins[axis][b].Expand(box.minPoint, box.maxPoint);
+            }
+        }
+    });
+    SAHBin (*bins)[MAX_BIN_COUNT] = chunkBins[0].bins;
+    for (int c = 1; c < chunkCount; ++c) {
+        for (int axis = 0; axis < 3; ++axis) {
+            for (int b = 0; b < binCount; ++b) {
+                bins[axis][b].Merge(chunkBins[c].bins[axis][b]);
+            }
+        }
     }
 
-    // 重建左右包围盒
-    vec3 minVertLeft(MAX, MAX, MAX), maxVertLeft(MIN, MIN, MIN);
-    vec3 minVertRight(MAX, MAX, MAX), maxVertRight(MIN, MIN, MIN);
-    // 重建左节点的包围盒
-    for (int i = 0; i < nface / 2; ++i) {
-        const BoundingBox3f& box = m_Mesh->GetBoundingBox(node->tris[i]);
-        for (int j = 0; j < 3; ++j) {
-            minVertLeft[j] = std::min(minVertLeft[j], box.minPoint[j]);
-            maxVertLeft[j] = std::max(maxVertLeft[j], box.maxPoint[j]);
+    float bestCost = MAX;
+    int bestAxis = -1, bestSplit = -1;
+    for (int axis = 0; axis < 3; ++axis) {
+        if (scale[axis] == 0.f) {
+            continue;
+        }
+        // 从右往左累积 rightArea[i]是桶i+1到最后一个桶的包围盒面积
+        float rightArea[MAX_BIN_COUNT];
+        int rightCount[MAX_BIN_COUNT];
+        SAHBin right;
+        for (int i = binCount - 1; i > 0; --i) {
+            right.Merge(bins[axis][i]);
+            rightArea[i - 1] = right.SurfaceArea();
+            rightCount[i - 1] = right.count;
+        }
+        // 从左往右扫描 在桶i和桶i+1之间划分
+        SAHBin left;
+        for (int i = 0; i < binCount - 1; ++i) {
+            left.Merge(bins[axis][i]);
+            if (left.count == 0 || rightCount[i] == 0) {
+                continue;
+            }
+            float cost = m_Config.traversalCost * nodeArea +
+                         m_Config.intersectCost * (left.SurfaceArea() * left.count + rightArea[i] * rightCount[i]);
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = i;
+            }
         }
     }
-    // 重建右节点的包围盒
-    for (int i = nface / 2; i < nface; ++i) {
-        const BoundingBox3f& box = m_Mesh->GetBoundingBox(node->tris[i]);
-        for (int j = 0; j < 3; ++j) {
-            minVertRight[j] = std::min(minVertRight[j], box.minPoint[j]);
-            maxVertRight[j] = std::max(maxVertRight[j], box.maxPoint[j]);
+
+    // 分裂不划算时做叶子 三角形太多时仍然强制分裂
+    float leafCost = m_Config.intersectCost * nface * nodeArea;
+    if (nface <= m_Config.maxLeafSize && (bestAxis < 0 || bestCost >= leafCost)) {
+        return;
+    }
+
+    // 左右包围盒就是划分两侧桶的包围盒之和
+    int mid;
+    SAHBin leftBox, rightBox;
+    if (bestAxis >= 0) {
+        float axisScale = scale[bestAxis], minCentroid = centroidBox.minPoint[bestAxis];
+        int* it = std::partition(tris, tris + nface, [&](int tri) {
+            return std::min(binCount - 1, (int)((m_Centroids[tri][bestAxis] - minCentroid) * axisScale)) <= bestSplit;
+        });
+        mid = it - tris;
+        for (int b = 0; b < binCount; ++b) {
+            (b <= bestSplit ? leftBox : rightBox).Merge(bins[bestAxis][b]);
+        }
+    }
+    else {
+        // 所有三角形中心重合 没法按位置划分 直接对半分
+        mid = nface / 2;
+        for (int i = 0; i < nface; ++i) {
+            (i < mid ? leftBox : rightBox).Expand(m_TriBoxes[tris[i]].minPoint, m_TriBoxes[tris[i]].maxPoint);
         }
     }
 
-    // 新建左右分支
-    node->left = new KDNode(BoundingBox3f(minVertLeft, maxVertLeft));
-    node->left->tris = std::vector<int>(node->tris.begin(), node->tris.begin() + nface / 2);
-    node->right = new KDNode(BoundingBox3f(minVertRight, maxVertRight));
-    node->right->tris = std::vector<int>(node->tris.begin() + nface / 2, node->tris.end());
+    // 新建左右分支 三角形已经按划分排好 子节点各取一段
+    node->left = new BuildNode(BoundingBox3f(leftBox.minPoint, leftBox.maxPoint), node->triOffset, mid);
+    node->right = new BuildNode(BoundingBox3f(rightBox.minPoint, rightBox.maxPoint), node->triOffset + mid, nface - mid);
 
-    // 清空该节点
-    node->tris.clear();
-    node->tris.shrink_to_fit();
+    // 递归分裂左右子节点 大的子树作为task并行构建 两个子树的三角形范围互不重叠
+    if (nface >= PARALLEL_SUBTREE_SIZE) {
+#pragma omp task
+        Split(node->left, depth + 1);
+        Split(node->right, depth + 1);
+#pragma omp taskwait
+    }
+    else {
+        Split(node->left, depth + 1);
+        Split(node->right, depth + 1);
+    }
+}
 
-    // 递归分裂左右子节点
+void Accel::PackLeaf(const BuildNode* leaf, int32_t& child, uint16_t& packetCount) {
+    child = ~(int32_t)m_Packets.size();
+    packetCount = (leaf->triCount + BVH_WIDTH - 1) / BVH_WIDTH;
+    for (int p = 0; p < packetCount; ++p) {
+        TriPacket packet = {};
+        for (int k = 0; k < BVH_WIDTH; ++k) {
+            int i = p * BVH_WIDTH + k;
+            if (i >= leaf->triCount) {
+                packet.triIdx[k] = -1;
+                continue;
+            }
+            int tri = m_TriIndices[leaf->triOffset + i];
+            vec3 verts[3];
+            for (int n = 0; n < 3; ++n) {
+                verts[n] = m_Mesh->vert(tri, n);
+            }
+            if (!m_Watertight) {
+                verts[1] = verts[1] - verts[0];
+                verts[2] = verts[2] - verts[0];
+            }
+            for (int n = 0; n < 3; ++n) {
+                for (int j = 0; j < 3; ++j) {
+                    packet.p[n][j][k] = verts[n][j];
+                }
+            }
+            packet.triIdx[k] = tri;
+        }
+        m_Packets.push_back(packet);
+    }
     m_LeafNum++;
-    m_NodeNum += 2;
-    Split(node->left, depth + 1);
-    Split(node->right, depth + 1);
+}
+
+int Accel::Collapse(BuildNode* node, int depth) {
+    m_MaxDepth = std::max(m_MaxDepth, depth);
+
+    // 收集子节点 每次展开表面积最大的内部子节点 它被光线访问的概率最大
+    BuildNode* children[BVH_WIDTH];
+    int childCount = 0;
+    if (node->left == nullptr) {
+        children[childCount++] = node;      // 整棵树只有一个叶子
+    }
+    else {
+        children[childCount++] = node->left;
+        children[childCount++] = node->right;
+        delete node;
+    }
+    while (childCount < BVH_WIDTH) {
+        int best = -1;
+        float bestArea = -1.f;
+        for (int i = 0; i < childCount; ++i) {
+            if (children[i]->left != nullptr && children[i]->boundingBox.SurfaceArea() > bestArea) {
+                bestArea = children[i]->boundingBox.SurfaceArea();
+                best = i;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        BuildNode* expand = children[best];
+        children[best] = expand->left;
+        children[childCount++] = expand->right;
+        delete expand;
+    }
+
+    int idx = m_Nodes.size();
+    m_Nodes.push_back(WideNode());
+    for (int i = 0; i < BVH_WIDTH; ++i) {
+        WideNode& wide = m_Nodes[idx];
+        if (i >= childCount) {
+            for (int j = 0; j < 3; ++j) {
+                wide.bounds[j][i] = MAX;
+                wide.bounds[j + 3][i] = MIN;
+            }
+            wide.child[i] = 0;
+            wide.packetCount[i] = 0;
+            continue;
+        }
+        BuildNode* child = children[i];
+        for (int j = 0; j < 3; ++j) {
+            wide.bounds[j][i] = child->boundingBox.minPoint[j];
+            wide.bounds[j + 3][i] = child->boundingBox.maxPoint[j];
+        }
+        if (child->left == nullptr) {
+            PackLeaf(child, wide.child[i], wide.packetCount[i]);
+            delete child;
+        }
+        else {
+            wide.packetCount[i] = 0;
+            // 递归时m_Nodes可能扩容 不能再用上面的引用
+            int childIdx = Collapse(child, depth + 1);
+            m_Nodes[idx].child[i] = childIdx;
+        }
+    }
+    m_Nodes[idx].pad[0] = m_Nodes[idx].pad[1] = 0;
+    return idx;
+}
+
+// 各节点的代价乘以节点面积求和 再按根节点面积归一化
+float Accel::ComputeSAHCost(const BuildNode* node) const {
+    float area = node->boundingBox.SurfaceArea();
+    if (node->left == nullptr) {
+        return area * m_Config.intersectCost * node->triCount;
+    }
+    return area * m_Config.traversalCost + ComputeSAHCost(node->left) + ComputeSAHCost(node->right);
 }
 
 void Accel::SetMesh(Model* mesh) {
@@ -83,106 +301,236 @@ void Accel::SetMesh(Model* mesh) {
 }
 
 void Accel::Build() {
+#pragma omp parallel
+#pragma omp single
+    BuildTask();
+}
+
+// 所有加速结构共用一个线程组 网格之间和每个网格内部的子树都作为task调度 大小悬殊的网格也能分满所有核
+void Accel::Build(const std::vector<Accel*>& accels) {
+#pragma omp parallel
+#pragma omp single
+    for (size_t i = 0; i < accels.size(); ++i) {
+        Accel* accel = accels[i];
+#pragma omp task firstprivate(accel)
+        accel->BuildTask();
+    }
+}
+
+void Accel::BuildTask() {
     if (m_Mesh == nullptr) {
         return;
     }
 
-#ifdef _DEBUG
     // timer start
     LARGE_INTEGER cpuFreq;
     LARGE_INTEGER startTime;
     LARGE_INTEGER endTime;
-    double runtime = 0.0;
     QueryPerformanceFrequency(&cpuFreq);
     QueryPerformanceCounter(&startTime);
-#endif
 
     Clear();
-    m_TreeRoot = new KDNode(m_Mesh->GetBoundingBox());
+    m_Watertight = m_Config.watertight;
     int nface = m_Mesh->nfaces();
-    for (int i = 0; i < nface; ++i) {
-        m_TreeRoot->tris.emplace_back(i);   // 先将所有的三角形放在一个node里
-    }
-    m_NodeNum = 1;
-    m_LeafNum = 1;
-    m_MaxDepth = 1;
-    Split(m_TreeRoot, 1);                   // 然后递归划分
+    m_TriBoxes.resize(nface);
+    m_Centroids.resize(nface);
+    m_TriIndices.resize(nface);
+    // 各段只写自己的三角形 模型里缓存的包围盒也是各存各的
+    ForEachChunk(nface, [&](int /*c*/, int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            m_TriBoxes[i] = m_Mesh->GetBoundingBox(i);
+            m_Centroids[i] = m_TriBoxes[i].GetCenter();
+            m_TriIndices[i] = i;            // 先将所有的三角形放在一个node里
+        }
+    });
+    BuildNode* root = new BuildNode(m_Mesh->GetBoundingBox(), 0, nface);
+    Split(root, 1);                         // 然后递归划分
+    float rootArea = root->boundingBox.SurfaceArea();
+    m_SAHCost = rootArea > 0.f ? ComputeSAHCost(root) / rootArea : 0.f;
+    m_NodeNum = 0;
+    m_LeafNum = 0;
+    m_MaxDepth = 0;
+    Collapse(root, 1);
+    m_NodeNum = m_Nodes.size();
+    m_TriBoxes.clear();
+    m_TriBoxes.shrink_to_fit();
+    m_Centroids.clear();
+    m_Centroids.shrink_to_fit();
+    m_TriIndices.clear();
+    m_TriIndices.shrink_to_fit();
 
-#ifdef _DEBUG
     // timer end
     QueryPerformanceCounter(&endTime);
-    runtime = (((endTime.QuadPart - startTime.QuadPart) * 1000.0f) / cpuFreq.QuadPart);
-    qDebug() << "build time: " << runtime << "ms";
+    m_BuildTime = (((endTime.QuadPart - startTime.QuadPart) * 1000.0f) / cpuFreq.QuadPart);
+
+#ifdef _DEBUG
+    qDebug() << "build time: " << m_BuildTime << "ms" << "\tSAH cost: " << m_SAHCost;
     qDebug() << "depth: " << m_MaxDepth << "\tnode num: " << m_NodeNum << "\tleaf num: " << m_LeafNum;
 #endif
 }
 
-void Accel::Clear(KDNode* node) {
-    if (node == nullptr) {
-        return;
+void Accel::Clear() {
+    m_Nodes.clear();
+    m_Packets.clear();
+}
+
+// 光线与一个节点的4个子节点包围盒做slab测试 返回相交子节点的掩码 tNear是各子节点的进入距离
+// nearRow/farRow按光线方向的符号选出进入和离开时碰到的那一面 0 * inf得到NaN时保留原来的区间
+// 离开距离放大1 + 2 * gamma(3)抵消减法和乘法的舍入误差 顶点正好在包围盒面上的三角形不会因为误差被跳过
+static const float HALF_EPSILON = std::numeric_limits<float>::epsilon() * 0.5f;
+static const float FAR_SCALE = 1.f + 2.f * (3.f * HALF_EPSILON) / (1.f - 3.f * HALF_EPSILON);
+#ifdef RASTER_SSE2
+static inline int IntersectBounds(const float (*bounds)[Accel::BVH_WIDTH], const __m128* origin, const __m128* invDir,
+                                  const int* nearRow, const int* farRow, float tMax, float* tNear) {
+    __m128 t0 = _mm_setzero_ps();
+    __m128 t1 = _mm_set1_ps(tMax);
+    for (int j = 0; j < 3; ++j) {
+        __m128 n = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds[nearRow[j]]), origin[j]), invDir[j]);
+        __m128 f = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds[farRow[j]]), origin[j]), invDir[j]);
+        f = _mm_mul_ps(f, _mm_set1_ps(FAR_SCALE));
+        t0 = _mm_max_ps(n, t0);     // 有NaN时返回第二个操作数
+        t1 = _mm_min_ps(f, t1);
     }
-    Clear(node->left);
-    Clear(node->right);
-    delete node;
-    node = nullptr;
+    _mm_storeu_ps(tNear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
 }
+#else
+static inline int IntersectBounds(const float (*bounds)[Accel::BVH_WIDTH], const vec3& origin, const vec3& invDir,
+                                  const int* nearRow, const int* farRow, float tMax, float* tNear) {
+    int mask = 0;
+    for (int i = 0; i < Accel::BVH_WIDTH; ++i) {
+        float t0 = 0.f, t1 = tMax;
+        for (int j = 0; j < 3; ++j) {
+            t0 = std::max(t0, (bounds[nearRow[j]][i] - origin[j]) * invDir[j]);
+            t1 = std::min(t1, (bounds[farRow[j]][i] - origin[j]) * invDir[j] * FAR_SCALE);
+        }
+        tNear[i] = t0;
+        mask |= (t0 <= t1) << i;
+    }
+    return mask;
+}
+#endif
 
-void Accel::Clear() {
-    Clear(m_TreeRoot);
-    m_TreeRoot = nullptr;
+// 光线与一个包里的4个三角形做Möller–Trumbore求交 计算顺序与Model::Intersect一致 返回交点在(0, tMax)内的三角形掩码
+// t是交点距离 u v是v1 v2的重心坐标 行列式为0(平行或空位)时结果是NaN 所有比较都不成立
+#ifdef RASTER_SSE2
+static inline __m128 Dot3(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz) {
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(az, bz), _mm_mul_ps(ay, by)), _mm_mul_ps(ax, bx));
 }
 
-bool Accel::IntersectHelper(const Ray &ray, KDNode* node, HitResult &hitResult, bool shadow) {
-    if (!node->boundingBox.Intersect(ray)) {
-        return false;
-    }
+static inline int IntersectTriangles(const float (*v0)[Accel::BVH_WIDTH], const float (*e1)[Accel::BVH_WIDTH], const float (*e2)[Accel::BVH_WIDTH],
+                                     const __m128* origin, const __m128* dir, float tMax, float* t, float* u, float* v) {
+    __m128 e1x = _mm_loadu_ps(e1[0]), e1y = _mm_loadu_ps(e1[1]), e1z = _mm_loadu_ps(e1[2]);
+    __m128 e2x = _mm_loadu_ps(e2[0]), e2y = _mm_loadu_ps(e2[1]), e2z = _mm_loadu_ps(e2[2]);
+    // s1 = dir x e2
+    __m128 s1x = _mm_sub_ps(_mm_mul_ps(dir[1], e2z), _mm_mul_ps(dir[2], e2y));
+    __m128 s1y = _mm_sub_ps(_mm_mul_ps(dir[2], e2x), _mm_mul_ps(dir[0], e2z));
+    __m128 s1z = _mm_sub_ps(_mm_mul_ps(dir[0], e2y), _mm_mul_ps(dir[1], e2x));
+    __m128 prefix = _mm_div_ps(_mm_set1_ps(1.f), Dot3(s1x, s1y, s1z, e1x, e1y, e1z));
+    // s = origin - v0  s2 = s x e1
+    __m128 sx = _mm_sub_ps(origin[0], _mm_loadu_ps(v0[0]));
+    __m128 sy = _mm_sub_ps(origin[1], _mm_loadu_ps(v0[1]));
+    __m128 sz = _mm_sub_ps(origin[2], _mm_loadu_ps(v0[2]));
+    __m128 s2x = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    __m128 s2y = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    __m128 s2z = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
 
-    // 叶子节点
-    if (node->left == nullptr && node->right == nullptr) {
-        bool hit = false;
-        float tMin = MAX;
-        int hitIdx;
-        vec3 barycentric;
-        int nface = node->tris.size();
-        for (int i = 0; i < nface; ++i) {
-            float t;
-            vec3 bar;
-            if (m_Mesh->Intersect(node->tris[i], ray, bar, t) && t < tMin) {
-                if (shadow) {   // 检测shadow的时候不需要知道光线碰撞点信息 只需要知道光线有没有被遮挡
-                    return true;
-                }
-                tMin = t;
-                barycentric = bar;
-                hitIdx = node->tris[i];
-                hit = true;
-            }
-        }
-        hitResult.barycentric = barycentric;
-        hitResult.hitIdx = hitIdx;
-        hitResult.t = tMin;
-        return hit;
+    __m128 b1 = _mm_mul_ps(prefix, Dot3(s1x, s1y, s1z, sx, sy, sz));
+    __m128 b2 = _mm_mul_ps(prefix, Dot3(s2x, s2y, s2z, dir[0], dir[1], dir[2]));
+    __m128 b0 = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(1.f), b1), b2);
+    __m128 dist = _mm_mul_ps(prefix, Dot3(s2x, s2y, s2z, e2x, e2y, e2z));
+
+    __m128 zero = _mm_setzero_ps();
+    __m128 valid = _mm_and_ps(_mm_cmpge_ps(b0, zero), _mm_cmpge_ps(b1, zero));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(b2, zero));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(dist, zero));
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(dist, _mm_set1_ps(tMax)));
+    _mm_storeu_ps(t, dist);
+    _mm_storeu_ps(u, b1);
+    _mm_storeu_ps(v, b2);
+    return _mm_movemask_ps(valid);
+}
+#else
+static inline int IntersectTriangles(const float (*v0)[Accel::BVH_WIDTH], const float (*e1)[Accel::BVH_WIDTH], const float (*e2)[Accel::BVH_WIDTH],
+                                     const vec3& origin, const vec3& dir, float tMax, float* t, float* u, float* v) {
+    int mask = 0;
+    for (int i = 0; i < Accel::BVH_WIDTH; ++i) {
+        vec3 v01(e1[0][i], e1[1][i], e1[2][i]);
+        vec3 v02(e2[0][i], e2[1][i], e2[2][i]);
+        vec3 s = origin - vec3(v0[0][i], v0[1][i], v0[2][i]);
+        vec3 s1 = cross(dir, v02);
+        vec3 s2 = cross(s, v01);
+        float prefix = 1.f / (s1 * v01);
+        u[i] = prefix * (s1 * s);
+        v[i] = prefix * (s2 * dir);
+        t[i] = prefix * (s2 * v02);
+        float b0 = 1.f - u[i] - v[i];
+        mask |= (b0 >= 0.f && u[i] >= 0.f && v[i] >= 0.f && t[i] >= 0.f && t[i] < tMax) << i;
     }
+    return mask;
+}
+#endif
 
-    // 非叶子节点
-    hitResult.t = MAX;      // 防止检测右节点时(tmpResult.t < hitResult.t)出现bug
-    HitResult tmpResult;
-    bool hitLeft, hitRight;
-    if ((hitLeft = IntersectHelper(ray, node->left, tmpResult, shadow))) {
-        if (shadow) {
-            return true;
-        }
-        hitResult = tmpResult;
+// 光线与一个包里的4个三角形做watertight求交 顶点先平移到光线起点 k[2]轴换成z后剪切使光线沿z轴
+// 三条边函数U V W(对面顶点的未归一化重心坐标)不异号时相交 共享边上的点U V W完全相同 不会两边都漏掉
+// 和为0(退化或空位)时剔除 u v同样是v1 v2的重心坐标 shear是(Sx, Sy, Sz)
+#ifdef RASTER_SSE2
+static inline int IntersectTrianglesWatertight(const float (*p)[3][Accel::BVH_WIDTH], const __m128* origin, const int* k,
+                                               const __m128* shear, float tMax, float* t, float* u, float* v) {
+    __m128 x[3], y[3], z[3];
+    for (int n = 0; n < 3; ++n) {
+        __m128 pz = _mm_sub_ps(_mm_loadu_ps(p[n][k[2]]), origin[k[2]]);
+        x[n] = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(p[n][k[0]]), origin[k[0]]), _mm_mul_ps(shear[0], pz));
+        y[n] = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(p[n][k[1]]), origin[k[1]]), _mm_mul_ps(shear[1], pz));
+        z[n] = _mm_mul_ps(shear[2], pz);
     }
-    if ((hitRight = IntersectHelper(ray, node->right, tmpResult, shadow))) {
-        if (shadow) {
-            return true;
+    __m128 U = _mm_sub_ps(_mm_mul_ps(x[2], y[1]), _mm_mul_ps(y[2], x[1]));
+    __m128 V = _mm_sub_ps(_mm_mul_ps(x[0], y[2]), _mm_mul_ps(y[0], x[2]));
+    __m128 W = _mm_sub_ps(_mm_mul_ps(x[1], y[0]), _mm_mul_ps(y[1], x[0]));
+
+    __m128 zero = _mm_setzero_ps();
+    __m128 neg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(U, zero), _mm_cmplt_ps(V, zero)), _mm_cmplt_ps(W, zero));
+    __m128 pos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(U, zero), _mm_cmpgt_ps(V, zero)), _mm_cmpgt_ps(W, zero));
+    __m128 det = _mm_add_ps(_mm_add_ps(U, V), W);
+    __m128 rcpDet = _mm_div_ps(_mm_set1_ps(1.f), det);
+    __m128 dist = _mm_mul_ps(rcpDet, _mm_add_ps(_mm_add_ps(_mm_mul_ps(U, z[0]), _mm_mul_ps(V, z[1])), _mm_mul_ps(W, z[2])));
+
+    __m128 valid = _mm_andnot_ps(_mm_and_ps(neg, pos), _mm_cmpneq_ps(det, zero));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(dist, zero));
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(dist, _mm_set1_ps(tMax)));
+    _mm_storeu_ps(t, dist);
+    _mm_storeu_ps(u, _mm_mul_ps(V, rcpDet));
+    _mm_storeu_ps(v, _mm_mul_ps(W, rcpDet));
+    return _mm_movemask_ps(valid);
+}
+#else
+static inline int IntersectTrianglesWatertight(const float (*p)[3][Accel::BVH_WIDTH], const vec3& origin, const int* k,
+                                               const vec3& shear, float tMax, float* t, float* u, float* v) {
+    int mask = 0;
+    for (int i = 0; i < Accel::BVH_WIDTH; ++i) {
+        float x[3], y[3], z[3];
+        for (int n = 0; n < 3; ++n) {
+            float pz = p[n][k[2]][i] - origin[k[2]];
+            x[n] = p[n][k[0]][i] - origin[k[0]] - shear[0] * pz;
+            y[n] = p[n][k[1]][i] - origin[k[1]] - shear[1] * pz;
+            z[n] = shear[2] * pz;
         }
-        if (tmpResult.t < hitResult.t) {
-            hitResult = tmpResult;
+        float U = x[2] * y[1] - y[2] * x[1];
+        float V = x[0] * y[2] - y[0] * x[2];
+        float W = x[1] * y[0] - y[1] * x[0];
+        float det = U + V + W;
+        if (((U < 0.f || V < 0.f || W < 0.f) && (U > 0.f || V > 0.f || W > 0.f)) || det == 0.f) {
+            continue;
         }
+        float rcpDet = 1.f / det;
+        t[i] = rcpDet * (U * z[0] + V * z[1] + W * z[2]);
+        u[i] = V * rcpDet;
+        v[i] = W * rcpDet;
+        mask |= (t[i] >= 0.f && t[i] < tMax) << i;
     }
-    return hitLeft || hitRight;
+    return mask;
 }
+#endif
 
 bool Accel::Intersect(const Ray& ray, HitResult& hitResult, bool shadow) {
 #ifdef _DEBUG
@@ -195,7 +543,107 @@ bool Accel::Intersect(const Ray& ray, HitResult& hitResult, bool shadow) {
     QueryPerformanceCounter(&startTime);
 #endif
 
-    bool ret = IntersectHelper(ray, m_TreeRoot, hitResult, shadow);
+    if (m_Nodes.empty()) {
+        return false;
+    }
+
+    // 与包围盒的slab求交都用乘法 方向为负的轴进入时碰到的是最大值
+    vec3 invDir(1.f / ray.dir.x, 1.f / ray.dir.y, 1.f / ray.dir.z);
+    int nearRow[3], farRow[3];
+    for (int j = 0; j < 3; ++j) {
+        bool dirIsNeg = invDir[j] < 0.f;
+        nearRow[j] = dirIsNeg ? j + 3 : j;
+        farRow[j] = dirIsNeg ? j : j + 3;
+    }
+
+    // watertight求交时方向绝对值最大的轴作为z 剪切系数每条光线只算一次
+    int k[3] = {0, 1, 2};
+    vec3 shearCoef;
+    if (m_Watertight) {
+        vec3 absDir(std::abs(ray.dir.x), std::abs(ray.dir.y), std::abs(ray.dir.z));
+        k[2] = absDir.x > absDir.y ? (absDir.x > absDir.z ? 0 : 2) : (absDir.y > absDir.z ? 1 : 2);
+        k[0] = (k[2] + 1) % 3;
+        k[1] = (k[0] + 1) % 3;
+        shearCoef = vec3(ray.dir[k[0]] / ray.dir[k[2]], ray.dir[k[1]] / ray.dir[k[2]], 1.f / ray.dir[k[2]]);
+    }
+
+#ifdef RASTER_SSE2
+    __m128 origin[3], dir[3], inv[3], shear[3];
+    for (int j = 0; j < 3; ++j) {
+        origin[j] = _mm_set1_ps(ray.origin[j]);
+        dir[j] = _mm_set1_ps(ray.dir[j]);
+        inv[j] = _mm_set1_ps(invDir[j]);
+        shear[j] = _mm_set1_ps(shearCoef[j]);
+    }
+#else
+    const vec3& origin = ray.origin;
+    const vec3& dir = ray.dir;
+    const vec3& inv = invDir;
+    const vec3& shear = shearCoef;
+#endif
+
+    // 每访问一个内部节点出栈一个 最多压入BVH_WIDTH个
+    struct StackEntry {
+        int32_t child;
+        int packetCount;
+        float tNear;
+    };
+    StackEntry stack[MAX_STACK_DEPTH * (BVH_WIDTH - 1) + 1];
+    int stackSize = 0;
+    stack[stackSize++] = {0, 0, 0.f};
+    float tMax = MAX;               // 目前最近的交点 比它远的节点不用再访问
+    bool ret = false;
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+        if (entry.tNear > tMax) {
+            continue;
+        }
+
+        if (entry.child < 0) {
+            // 叶子节点
+            const TriPacket* packets = &m_Packets[~entry.child];
+            for (int p = 0; p < entry.packetCount; ++p) {
+                const TriPacket& packet = packets[p];
+                float t[BVH_WIDTH], u[BVH_WIDTH], v[BVH_WIDTH];
+                int mask = m_Watertight ? IntersectTrianglesWatertight(packet.p, origin, k, shear, tMax, t, u, v) :
+                                          IntersectTriangles(packet.p[0], packet.p[1], packet.p[2], origin, dir, tMax, t, u, v);
+                if (mask == 0) {
+                    continue;
+                }
+                if (shadow) {   // 检测shadow的时候不需要知道光线碰撞点信息 只需要知道光线有没有被遮挡
+                    return true;
+                }
+                for (int k = 0; k < BVH_WIDTH; ++k) {
+                    if ((mask >> k & 1) && t[k] < tMax) {
+                        tMax = t[k];
+                        hitResult.barycentric = vec3(1.f - u[k] - v[k], u[k], v[k]);
+                        hitResult.hitIdx = packet.triIdx[k];
+                        hitResult.t = t[k];
+                        ret = true;
+                    }
+                }
+            }
+            continue;
+        }
+
+        // 内部节点 相交的子节点按进入距离从远到近压栈 近的先出栈
+        const WideNode& node = m_Nodes[entry.child];
+        float tNear[BVH_WIDTH];
+        int mask = IntersectBounds(node.bounds, origin, inv, nearRow, farRow, tMax, tNear);
+        int base = stackSize;
+        for (int i = 0; i < BVH_WIDTH; ++i) {
+            if (!(mask >> i & 1)) {
+                continue;
+            }
+            StackEntry child = {node.child[i], node.packetCount[i], tNear[i]};
+            int k = stackSize++;
+            for (; k > base && stack[k - 1].tNear < child.tNear; --k) {
+                stack[k] = stack[k - 1];
+            }
+            stack[k] = child;
+        }
+    }
+
     if (ret) {
         hitResult.ray = ray;
         hitResult.hitPoint = ray.origin + hitResult.t * ray.dir;
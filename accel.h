@@ -4,32 +4,94 @@
 #include "geometry.h"
 #include "model.h"
 #include <vector>
+#include <cstdint>
 
 
+/* 模型三角面片的BVH 按分桶的SAH(surface area heuristic)自顶向下划分
+ * 每个节点沿三个轴把三角形中心各分进binCount个桶 在桶边界中选代价最小的划分
+ *   C_split = C_trav + C_isect * (A_left * N_left + A_right * N_right) / A
+ * 最小代价不低于直接做叶子的代价(C_isect * N)并且三角形不超过maxLeafSize时停止分裂
+ *
+ * 建好的二叉树再合并成4叉树(BVH4) 每次把表面积最大的内部子节点换成它的两个子节点 直到凑满4个
+ * 4个子节点的包围盒按SoA存放 一次SSE的slab测试同时求4个子节点 按进入距离由近到远访问
+ * 叶子的三角形预先4个一组打包成TriPacket(SoA) 一次SSE同时求4个三角形 求交时只读包里的数据 不再经过模型的顶点索引
+ * 默认用Möller–Trumbore 包里存v0和两条边 结果与Model::Intersect一致
+ * watertight时用Woop等人的watertight算法 包里存三个顶点 光线方向最大的轴换到z后剪切成沿z轴
+ * 相邻三角形共享的边在变换后完全相同 光线不会从网格的接缝中漏过去
+ * 进入距离比已有交点远的子节点直接跳过
+ *
+ * 构建用OpenMP task并行: 三角形很多的节点分段并行求包围盒和分桶 三角形较多的子树各自作为一个task
+ * 加载场景时用Build(accels)一次构建所有网格 网格之间也并行
+ */
 class Accel {
-    struct KDNode {
+public:
+    static const int MAX_BIN_COUNT = 32;
+
+    // 代价模型和叶子大小
+    struct BuildConfig {
+        int binCount = 16;              // 每个轴的桶数 不超过MAX_BIN_COUNT
+        int minLeafSize = 1;            // 三角形数不超过它时直接做叶子
+        int maxLeafSize = 8;            // 三角形数超过它时即使SAH认为不划算也继续分裂
+        float traversalCost = 1.f;      // 访问一个内部节点的代价 与两个子节点包围盒求交
+        float intersectCost = 1.f;      // 与一个三角形求交的代价
+        bool watertight = false;        // 三角形用watertight算法求交 用于封闭的场景网格
+    };
+
+    static const int BVH_WIDTH = 4;         // 每个节点的子节点数 也是一个三角形包的大小 对应SSE的4个float
+    static const int MAX_STACK_DEPTH = 64;  // 二叉树深度超过它时Build会强制做叶子
+    static const int PARALLEL_CHUNK_SIZE = 32768;   // 节点的三角形超过它时分段并行分桶
+    static const int PARALLEL_SUBTREE_SIZE = 4096;  // 子树的三角形不少于它时作为单独的task构建
+
+private:
+    // 构建时的二叉树节点 合并成WideNode后删除
+    struct BuildNode {
         BoundingBox3f boundingBox;
-        std::vector<int> tris;
-        KDNode* left = nullptr;
-        KDNode* right = nullptr;
-
-        KDNode(BoundingBox3f _box, KDNode* _left = nullptr, KDNode* _right = nullptr) {
-            boundingBox = _box;
-            left = _left;
-            right = _right;
-        }
+        int triOffset, triCount;        // 叶子的三角形在m_TriIndices中的范围
+        BuildNode* left = nullptr;
+        BuildNode* right = nullptr;
+
+        BuildNode(BoundingBox3f _box, int _triOffset, int _triCount) :
+            boundingBox(_box), triOffset(_triOffset), triCount(_triCount) {}
+    };
+
+    // 4叉树节点 bounds[0..2]是三个轴的最小值 bounds[3..5]是最大值 每一行是4个子节点
+    // 不足4个子节点时空位的包围盒是反的(min > max) 与任何光线都不相交
+    struct WideNode {
+        float bounds[6][BVH_WIDTH];
+        int32_t child[BVH_WIDTH];       // >= 0: 内部节点的序号 < 0: 叶子 ~child是第一个三角形包在m_Packets中的位置
+        uint16_t packetCount[BVH_WIDTH];    // 叶子的三角形包数目
+        uint32_t pad[2];
+    };
+    static_assert(sizeof(WideNode) == 128, "一个节点正好两条cache line");
+
+    // 4个三角形 每个点的三个分量各存成一行 不足4个时空位全为0 求交时行列式为0被剔除
+    // Möller–Trumbore: p[0] = v0 p[1] = v1 - v0 p[2] = v2 - v0  watertight: p[0..2] = v0 v1 v2
+    struct TriPacket {
+        float p[3][3][BVH_WIDTH];
+        int32_t triIdx[BVH_WIDTH];      // 空位为-1
     };
 
     Model* m_Mesh = nullptr;
 
 private:
-    KDNode* m_TreeRoot = nullptr;
+    std::vector<WideNode> m_Nodes;      // m_Nodes[0]是根节点
+    std::vector<TriPacket> m_Packets;   // 按叶子顺序排列的三角形包
     int m_MaxDepth = 0, m_LeafNum = 0, m_NodeNum = 0;
-    int m_SplitTermination = 5;     // 当叶子节点的三角形数量小于此数量时停止分裂
+    BuildConfig m_Config;
+    bool m_Watertight = false;      // 当前m_Packets的存放方式 构建时从m_Config取
+    float m_SAHCost = 0.f;          // 整棵树的SAH代价 按根节点面积归一化
+    double m_BuildTime = 0.0;       // ms
+
+    // 构建时的临时数据 避免划分时反复取模型的包围盒
+    std::vector<BoundingBox3f> m_TriBoxes;
+    std::vector<vec3> m_Centroids;
+    std::vector<int> m_TriIndices;      // 划分时原地partition 每个叶子的三角形是其中连续的一段
 
-    void Split(KDNode* node, int depth);
-    void Clear(KDNode* node);
-    bool IntersectHelper(const Ray& ray, KDNode* node, HitResult& hitResult, bool shadow);
+    void BuildTask();                       // 在OpenMP的parallel区域中调用 内部的并行都用task
+    void Split(BuildNode* node, int depth);
+    int Collapse(BuildNode* node, int depth);   // 深度优先写入m_Nodes 同时删除构建节点并统计节点数目 返回该节点的序号
+    void PackLeaf(const BuildNode* leaf, int32_t& child, uint16_t& packetCount);
+    float ComputeSAHCost(const BuildNode* node) const;     // 二叉树各节点的代价乘以面积之和 合并前计算
 
 public:
     Accel();
@@ -37,9 +99,16 @@ public:
     ~Accel();
 
     void SetMesh(Model* mesh);
+    void SetBuildConfig(const BuildConfig& config) { m_Config = config; }   // 下一次Build生效
     void Build();
+    static void Build(const std::vector<Accel*>& accels);  // 并行构建多个加速结构
     void Clear();
     bool Intersect(const Ray& ray, HitResult& hitResult, bool shadow = false);
+
+    float GetSAHCost() const { return m_SAHCost; }
+    double GetBuildTime() const { return m_BuildTime; }
+    int GetNodeNum() const { return m_NodeNum; }
+    int GetLeafNum() const { return m_LeafNum; }
 };
 
 #endif // ACCEL_H
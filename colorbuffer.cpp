@@ -0,0 +1,64 @@
+#include "colorbuffer.h"
+#include <algorithm>
+
+ColorBuffer::ColorBuffer(int width, int height, Format format, int samples) :
+    m_Width(width), m_Height(height), m_Samples(samples), m_Format(format)
+{
+    m_TileCountX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    m_TileCountY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    if (format == FORMAT_RGBA8) {
+        m_Data = new QRgb[width * height * samples];
+    }
+    else {
+        m_HDRData = new float[4 * width * height * samples];
+    }
+    m_TileCleared.resize(m_TileCountX * m_TileCountY, 0);
+}
+
+ColorBuffer::~ColorBuffer() {
+    delete[] m_Data;
+    delete[] m_HDRData;
+}
+
+void ColorBuffer::Clear(QRgb value) {
+    m_ClearValue = value;
+    std::fill(m_TileCleared.begin(), m_TileCleared.end(), 1);
+}
+
+void ColorBuffer::MaterializeTile(int tx, int ty) {
+    char& cleared = m_TileCleared[ty * m_TileCountX + tx];
+    if (!cleared) {
+        return;
+    }
+    int x0 = tx * TILE_SIZE, x1 = std::min(x0 + TILE_SIZE, m_Width);
+    int y0 = ty * TILE_SIZE, y1 = std::min(y0 + TILE_SIZE, m_Height);
+    if (m_Format == FORMAT_RGBA8) {
+        for (int y = y0; y < y1; ++y) {
+            std::fill(m_Data + (x0 + y * m_Width) * m_Samples, m_Data + (x1 + y * m_Width) * m_Samples, m_ClearValue);
+        }
+    }
+    else {
+        const float value[4] = {((m_ClearValue >> 16) & 0xff) / 255.f, ((m_ClearValue >> 8) & 0xff) / 255.f,
+                                (m_ClearValue & 0xff) / 255.f, ((m_ClearValue >> 24) & 0xff) / 255.f};
+        for (int y = y0; y < y1; ++y) {
+            float* row = m_HDRData + 4 * (x0 + y * m_Width) * m_Samples;
+            float* rowEnd = m_HDRData + 4 * (x1 + y * m_Width) * m_Samples;
+            for (; row < rowEnd; row += 4) {
+                std::copy(value, value + 4, row);
+            }
+        }
+    }
+    cleared = 0;
+}
+
+void ColorBuffer::Resolve() {
+    int tileCount = m_TileCountX * m_TileCountY;
+#pragma omp parallel for
+    for (int i = 0; i < tileCount; ++i) {
+        MaterializeTile(i % m_TileCountX, i / m_TileCountX);
+    }
+}
+
+void ColorBuffer::MarkWritten() {
+    std::fill(m_TileCleared.begin(), m_TileCleared.end(), 0);
+}
@@ -0,0 +1,56 @@
+#ifndef COLORBUFFER_H
+#define COLORBUFFER_H
+
+#include <vector>
+#include <QRgb>
+#include "depthbuffer.h"
+
+/* 颜色缓冲 按与光栅化器相同的64x64 tile延迟清空
+ * Clear只把每个tile标记为已清空 光栅化器第一次写某个tile前调用MaterializeTile再真正填充
+ * 没被写过的tile在Resolve时才填成清空值 作为贴图读取或显示之前需要调用Resolve
+ *
+ * FORMAT_RGBA32F是线性空间的浮点颜色 每个像素连续4个float(rgba) 不做clamp 由后处理tone mapping后再转成8bit
+ *
+ * 多重采样时每个像素有samples个颜色 同一像素的采样点连续存放 布局和DepthBuffer一致
+ * 不能直接显示或当贴图采样 需要先由MSAAResolvePass合成单采样的buffer
+ */
+class ColorBuffer {
+public:
+    static const int TILE_SIZE = DepthBuffer::TILE_SIZE;      // px
+
+    enum Format {
+        FORMAT_RGBA8 = 0,       // QRgb 用Data()访问
+        FORMAT_RGBA32F          // float[4] 用HDRData()访问
+    };
+
+private:
+    int m_Width, m_Height;
+    int m_Samples;                          // 每个像素的采样点数 1或4
+    int m_TileCountX, m_TileCountY;
+    Format m_Format;
+    QRgb* m_Data = nullptr;
+    float* m_HDRData = nullptr;
+    std::vector<char> m_TileCleared;        // 1: tile内的数据还没填成m_ClearValue
+    QRgb m_ClearValue = 0;
+
+public:
+    ColorBuffer(int width, int height, Format format = FORMAT_RGBA8, int samples = 1);
+    ~ColorBuffer();
+
+    QRgb* Data() { return m_Data; }
+    const QRgb* Data() const { return m_Data; }
+    float* HDRData() { return m_HDRData; }
+    const float* HDRData() const { return m_HDRData; }
+    int Width() const { return m_Width; }
+    int Height() const { return m_Height; }
+    int Samples() const { return m_Samples; }
+    Format GetFormat() const { return m_Format; }
+    int BytesPerPixel() const { return m_Samples * (m_Format == FORMAT_RGBA8 ? sizeof(QRgb) : 4 * sizeof(float)); }
+
+    void Clear(QRgb value);                 // 只设置标记 浮点格式清成value的各分量/255
+    void MaterializeTile(int tx, int ty);   // tile处于清空状态时填充清空值 只能由负责该tile的线程调用
+    void Resolve();                         // 填充所有还处于清空状态的tile
+    void MarkWritten();                     // 调用者会写满整个buffer 直接去掉所有清空标记
+};
+
+#endif // COLORBUFFER_H
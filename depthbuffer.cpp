@@ -0,0 +1,83 @@
+#include "depthbuffer.h"
+#include <algorithm>
+
+DepthBuffer::DepthBuffer(int width, int height, int samples) : m_Width(width), m_Height(height), m_Samples(samples) {
+    m_BlockCountX = (width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    m_BlockCountY = (height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    m_TileCountX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    m_TileCountY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    m_Data = new float[width * height * samples];
+    m_BlockMin.resize(m_BlockCountX * m_BlockCountY);
+    m_BlockMax.resize(m_BlockCountX * m_BlockCountY);
+    m_TileMin.resize(m_TileCountX * m_TileCountY);
+    m_TileCleared.resize(m_TileCountX * m_TileCountY, 0);
+}
+
+DepthBuffer::~DepthBuffer() {
+    delete[] m_Data;
+}
+
+void DepthBuffer::Clear(float value) {
+    m_ClearValue = value;
+    std::fill(m_TileCleared.begin(), m_TileCleared.end(), 1);
+    std::fill(m_TileMin.begin(), m_TileMin.end(), value);
+}
+
+void DepthBuffer::MaterializeTile(int tx, int ty) {
+    char& cleared = m_TileCleared[ty * m_TileCountX + tx];
+    if (!cleared) {
+        return;
+    }
+    int x0 = tx * TILE_SIZE, x1 = std::min(x0 + TILE_SIZE, m_Width);
+    int y0 = ty * TILE_SIZE, y1 = std::min(y0 + TILE_SIZE, m_Height);
+    for (int y = y0; y < y1; ++y) {
+        std::fill(m_Data + (x0 + y * m_Width) * m_Samples, m_Data + (x1 + y * m_Width) * m_Samples, m_ClearValue);
+    }
+    const int blocksPerTile = TILE_SIZE / BLOCK_SIZE;
+    int bx0 = tx * blocksPerTile, bx1 = std::min(bx0 + blocksPerTile, m_BlockCountX);
+    int by0 = ty * blocksPerTile, by1 = std::min(by0 + blocksPerTile, m_BlockCountY);
+    for (int by = by0; by < by1; ++by) {
+        std::fill(&m_BlockMin[by * m_BlockCountX + bx0], &m_BlockMin[by * m_BlockCountX + bx1 - 1] + 1, m_ClearValue);
+        std::fill(&m_BlockMax[by * m_BlockCountX + bx0], &m_BlockMax[by * m_BlockCountX + bx1 - 1] + 1, m_ClearValue);
+    }
+    cleared = 0;
+}
+
+void DepthBuffer::Resolve() {
+    int tileCount = m_TileCountX * m_TileCountY;
+#pragma omp parallel for
+    for (int i = 0; i < tileCount; ++i) {
+        MaterializeTile(i % m_TileCountX, i / m_TileCountX);
+    }
+}
+
+void DepthBuffer::UpdateBlock(int bx, int by) {
+    int x0 = bx * BLOCK_SIZE, x1 = std::min(x0 + BLOCK_SIZE, m_Width);
+    int y0 = by * BLOCK_SIZE, y1 = std::min(y0 + BLOCK_SIZE, m_Height);
+    float minDepth = m_Data[(x0 + y0 * m_Width) * m_Samples];
+    float maxDepth = minDepth;
+    for (int y = y0; y < y1; ++y) {
+        // 块内一行像素的所有采样点是连续的
+        const float* row = m_Data + (x0 + y * m_Width) * m_Samples;
+        int count = (x1 - x0) * m_Samples;
+        for (int i = 0; i < count; ++i) {
+            minDepth = std::min(minDepth, row[i]);
+            maxDepth = std::max(maxDepth, row[i]);
+        }
+    }
+    m_BlockMin[by * m_BlockCountX + bx] = minDepth;
+    m_BlockMax[by * m_BlockCountX + bx] = maxDepth;
+}
+
+void DepthBuffer::UpdateTile(int tx, int ty) {
+    const int blocksPerTile = TILE_SIZE / BLOCK_SIZE;
+    int bx0 = tx * blocksPerTile, bx1 = std::min(bx0 + blocksPerTile, m_BlockCountX);
+    int by0 = ty * blocksPerTile, by1 = std::min(by0 + blocksPerTile, m_BlockCountY);
+    float minDepth = m_BlockMin[by0 * m_BlockCountX + bx0];
+    for (int by = by0; by < by1; ++by) {
+        for (int bx = bx0; bx < bx1; ++bx) {
+            minDepth = std::min(minDepth, m_BlockMin[by * m_BlockCountX + bx]);
+        }
+    }
+    m_TileMin[ty * m_TileCountX + tx] = minDepth;
+}
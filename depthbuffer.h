@@ -0,0 +1,54 @@
+#ifndef DEPTHBUFFER_H
+#define DEPTHBUFFER_H
+
+#include <vector>
+
+/* 带层次深度(Hi-Z)的深度缓冲 深度从里到外增大 [far, near]->[0, 1]
+ * 每个8x8块记录块内深度的最小值和最大值 每个64x64 tile再记录块最小值中的最小值
+ * 三角形能产生的最大深度小于某块的最小深度时 这一块一定被挡住了
+ * 只有光栅化器写入深度 写完一个块后需要调用UpdateBlock 写完一个tile后调用UpdateTile
+ *
+ * Clear只把每个tile标记为已清空 不碰深度数据 光栅化器第一次写某个tile前调用MaterializeTile再真正填充
+ * 整帧都没被写过的tile不需要填充 深度要当作贴图读取前调用Resolve把剩下的tile填上
+ *
+ * 多重采样时每个像素有samples个深度 同一像素的采样点连续存放 第s个采样点在Data()[(x + y * width) * samples + s]
+ * Hi-Z统计块内所有采样点
+ */
+class DepthBuffer {
+public:
+    static const int BLOCK_SIZE = 8;        // px
+    static const int TILE_SIZE = 64;        // px 必须是BLOCK_SIZE的整数倍
+
+private:
+    int m_Width, m_Height;
+    int m_Samples;                          // 每个像素的采样点数 1或4
+    int m_BlockCountX, m_BlockCountY;
+    int m_TileCountX, m_TileCountY;
+    float* m_Data = nullptr;
+    std::vector<float> m_BlockMin, m_BlockMax;
+    std::vector<float> m_TileMin;
+    std::vector<char> m_TileCleared;        // 1: tile内的数据还没填成m_ClearValue
+    float m_ClearValue = 0.f;
+
+public:
+    DepthBuffer(int width, int height, int samples = 1);
+    ~DepthBuffer();
+
+    float* Data() { return m_Data; }
+    const float* Data() const { return m_Data; }
+    int Width() const { return m_Width; }
+    int Height() const { return m_Height; }
+    int Samples() const { return m_Samples; }
+
+    void Clear(float value);                // 只设置标记 Hi-Z的tile最小值同时更新 分箱时可以直接用
+    void MaterializeTile(int tx, int ty);   // tile处于清空状态时填充深度和块的Hi-Z 只能由负责该tile的线程调用
+    void Resolve();                         // 填充所有还处于清空状态的tile
+    void UpdateBlock(int bx, int by);       // 参数是块坐标 重新统计该块的最小最大深度
+    void UpdateTile(int tx, int ty);        // 参数是tile坐标 由块的最小深度统计tile的最小深度
+
+    float BlockMin(int bx, int by) const { return m_BlockMin[by * m_BlockCountX + bx]; }
+    float BlockMax(int bx, int by) const { return m_BlockMax[by * m_BlockCountX + bx]; }
+    float TileMin(int tx, int ty) const { return m_TileMin[ty * m_TileCountX + tx]; }
+};
+
+#endif // DEPTHBUFFER_H
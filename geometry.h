@@ -8,6 +8,10 @@
 
 #define PI 3.1415926535897932f
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RASTER_SSE2
+#endif
+
 template<int n>
 struct vec {
   vec() = default;
@@ -384,7 +388,7 @@ enum ProjectionType {ORTH, PERSP};
 
 vec3 cross(const vec3& v1, const vec3& v2);
 float clamp01(float v);
-mat4x4 TRS(vec3& translate, vec3& rotation, vec3& scale);   // 构造MODEL_MATRIX
+mat4x4 TRS(vec3& translate, vec3& rotation, vec3& scale);   // 构造model矩阵
 mat4x4 LookAt(vec3& dir, vec3& up);
 mat4x4 Projection(ProjectionType type, float znear, float zfar, float top, float down, float left, float right);
 mat4x4 PerspProjection(float fov, float aspect, float znear, float zfar); // fov: 竖直方向全角
@@ -425,6 +429,10 @@ struct BoundingBox3f {
                (inBox.maxPoint.x <= maxPoint.x) && (inBox.maxPoint.y <= maxPoint.y) && (inBox.maxPoint.z <= maxPoint.z);
     }
     vec3 GetCenter() const {return center;}
+    float SurfaceArea() const {
+        vec3 d = maxPoint - minPoint;
+        return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
 
     // 计算光线和包围盒的碰撞信息
     bool Intersect(const Ray& ray, vec2* hitResult = nullptr) const {
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <map>
+#include <tuple>
 #include "model.h"
 
 Model::Model(const std::string filename) : verts_(), uv_(), norms_(), facet_vrt_(), facet_tex_(), facet_nrm_() {
@@ -56,6 +58,7 @@ Model::Model(const std::string filename) : verts_(), uv_(), norms_(), facet_vrt_
     model_bounding_box_ = BoundingBox3f(minVert, maxVert);
     tri_bounding_box_ = new BoundingBox3f*[nfaces()];
     memset(tri_bounding_box_, 0, sizeof(BoundingBox3f*) * nfaces());
+    InitUniqueIndex();
     std::cerr << "# v# " << nverts() << " f# "  << nfaces() << " vt# " << uv_.size() << " vn# " << norms_.size() << std::endl;
 }
 
@@ -93,6 +96,18 @@ vec3 Model::normal(const int iface, const int nthvert) const {
     return norms_[facet_nrm_[iface*3+nthvert]];
 }
 
+int Model::vertIdx(const int iface, const int nthvert) const {
+    return facet_vrt_[iface*3+nthvert];
+}
+
+int Model::nunique() const {
+    return nunique_;
+}
+
+int Model::uniqueIdx(const int iface, const int nthvert) const {
+    return facet_unique_[iface*3+nthvert];
+}
+
 const std::string& Model::GetName() {
     return name;
 }
@@ -140,6 +155,17 @@ void Model::InitBoundingBox() {
     memset(tri_bounding_box_, 0, sizeof(BoundingBox3f*) * nfaces());
 }
 
+void Model::InitUniqueIndex() {
+    std::map<std::tuple<int, int, int>, int> uniqueMap;
+    int size = facet_vrt_.size();
+    facet_unique_.resize(size);
+    for (int i = 0; i < size; ++i) {
+        auto it = uniqueMap.insert(std::make_pair(std::make_tuple(facet_vrt_[i], facet_tex_[i], facet_nrm_[i]), (int)uniqueMap.size()));
+        facet_unique_[i] = it.first->second;
+    }
+    nunique_ = uniqueMap.size();
+}
+
 // 见GAMES101 Lec13
 bool Model::Intersect(int faceIdx, const Ray& ray, vec3& bar, float& t) {
     vec3 verts[3];
@@ -250,6 +276,7 @@ std::vector<Model*> Model::ModelReader(const std::string filename) {
     int size = ret.size();
     for (int i = 0; i < size; ++i) {
         ret[i]->InitBoundingBox();
+        ret[i]->InitUniqueIndex();
     }
 
     return ret;
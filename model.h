@@ -18,6 +18,8 @@ private:
     std::vector<int> facet_vrt_;
     std::vector<int> facet_tex_;  // indices in the above arrays per triangle
     std::vector<int> facet_nrm_;
+    std::vector<int> facet_unique_;         // 每个三角形顶点对应的唯一顶点序号 v/vt/vn都相同的顶点算同一个
+    int nunique_ = 0;                       // 唯一顶点数
     BoundingBox3f model_bounding_box_;      // 模型包围盒
     BoundingBox3f** tri_bounding_box_;      // 三角形包围盒
     std::string name;
@@ -32,11 +34,15 @@ public:
     vec3 vert(const int i) const;
     vec3 vert(const int iface, const int nthvert) const;
     vec2 uv(const int iface, const int nthvert) const;
+    int vertIdx(const int iface, const int nthvert) const;     // 顶点位置在verts_中的序号
+    int nunique() const;
+    int uniqueIdx(const int iface, const int nthvert) const;   // 顶点着色结果可以按这个序号复用
 
     const std::string& GetName();
     const BoundingBox3f& GetBoundingBox(int faceIdx) const;
     const BoundingBox3f& GetBoundingBox() const;        // TODO: 需要换成模型的多边形凸包
     void InitBoundingBox();             // 初始化模型local包围盒 同时为tri_bounding_box_分配内存
+    void InitUniqueIndex();             // 合并v/vt/vn都相同的三角形顶点 生成facet_unique_
 
     // 计算光线和模型的某个三角面片的交点 bar是重心坐标
     bool Intersect(int faceIdx, const Ray& ray, vec3& bar, float& t);
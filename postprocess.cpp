@@ -0,0 +1,490 @@
+#include "postprocess.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#ifdef RASTER_SSE2
+#include <emmintrin.h>
+#endif
+
+// 一个像素的rgba 有SSE2时就是一个寄存器
+#ifdef RASTER_SSE2
+typedef __m128 Pixel4;
+static inline Pixel4 Load4(const float* p) { return _mm_loadu_ps(p); }
+static inline void Store4(float* p, Pixel4 v) { _mm_storeu_ps(p, v); }
+static inline Pixel4 Zero4() { return _mm_setzero_ps(); }
+static inline Pixel4 Add4(Pixel4 a, Pixel4 b) { return _mm_add_ps(a, b); }
+static inline Pixel4 Mul4(Pixel4 a, Pixel4 b) { return _mm_mul_ps(a, b); }
+static inline Pixel4 Mul4(Pixel4 a, float s) { return _mm_mul_ps(a, _mm_set1_ps(s)); }
+static inline Pixel4 Div4(Pixel4 a, Pixel4 b) { return _mm_div_ps(a, b); }
+static inline Pixel4 AddScalar4(Pixel4 a, float s) { return _mm_add_ps(a, _mm_set1_ps(s)); }
+static inline Pixel4 Clamp014(Pixel4 a) { return _mm_min_ps(_mm_max_ps(a, _mm_setzero_ps()), _mm_set1_ps(1.f)); }
+#else
+struct Pixel4 { float v[4]; };
+static inline Pixel4 Load4(const float* p) { Pixel4 r; for (int i = 0; i < 4; ++i) r.v[i] = p[i]; return r; }
+static inline void Store4(float* p, Pixel4 a) { for (int i = 0; i < 4; ++i) p[i] = a.v[i]; }
+static inline Pixel4 Zero4() { Pixel4 r = {{0.f, 0.f, 0.f, 0.f}}; return r; }
+static inline Pixel4 Add4(Pixel4 a, Pixel4 b) { for (int i = 0; i < 4; ++i) a.v[i] += b.v[i]; return a; }
+static inline Pixel4 Mul4(Pixel4 a, Pixel4 b) { for (int i = 0; i < 4; ++i) a.v[i] *= b.v[i]; return a; }
+static inline Pixel4 Mul4(Pixel4 a, float s) { for (int i = 0; i < 4; ++i) a.v[i] *= s; return a; }
+static inline Pixel4 Div4(Pixel4 a, Pixel4 b) { for (int i = 0; i < 4; ++i) a.v[i] /= b.v[i]; return a; }
+static inline Pixel4 AddScalar4(Pixel4 a, float s) { for (int i = 0; i < 4; ++i) a.v[i] += s; return a; }
+static inline Pixel4 Clamp014(Pixel4 a) { for (int i = 0; i < 4; ++i) a.v[i] = clamp01(a.v[i]); return a; }
+#endif
+
+HBAOPass::HBAOPass(int width, int height, int downsample, float sampleRadius, int sampleCount, int dirCount, float temporalBlend) :
+    m_Width(width), m_Height(height), m_Downsample(downsample),
+    m_SampleRadius(sampleRadius), m_SampleCount(sampleCount), m_DirCount(dirCount), m_TemporalBlend(temporalBlend)
+{
+    m_AOWidth = (width + downsample - 1) / downsample;
+    m_AOHeight = (height + downsample - 1) / downsample;
+    m_AO.resize(m_AOWidth * m_AOHeight);
+    m_ViewDepth.resize(m_AOWidth * m_AOHeight);
+    m_History.resize(m_AOWidth * m_AOHeight);
+    m_HistoryDepth.resize(m_AOWidth * m_AOHeight);
+}
+
+bool HBAOPass::SampleView(int x, int y, vec3& view) const {
+    if (x < 0 || x >= m_Width || y < 0 || y >= m_Height) {
+        return false;
+    }
+    float z = m_Zbuffer[(x + y * m_Width) * m_DepthSamples];
+    // 排除没有物体的像素 深度清空值远小于0
+    if (z < 0.f) {
+        return false;
+    }
+    view = CoordNDCToView(*m_Uniforms, vec3(2.f * x / m_Width - 1.f, 2.f * y / m_Height - 1.f, z), 0);
+    return true;
+}
+
+// 每个方向取和中心深度差较小的一侧求差分 避免在物体边缘跨到背后的物体上
+vec3 HBAOPass::ReconstructNormal(int x, int y, const vec3& center) const {
+    vec3 left, right, down, up;
+    bool hasLeft = SampleView(x - 1, y, left), hasRight = SampleView(x + 1, y, right);
+    bool hasDown = SampleView(x, y - 1, down), hasUp = SampleView(x, y + 1, up);
+    if ((!hasLeft && !hasRight) || (!hasDown && !hasUp)) {
+        return (-1.f * center).normalize();
+    }
+
+    vec3 dx = (hasRight && (!hasLeft || std::abs(right.z - center.z) < std::abs(center.z - left.z))) ? right - center : center - left;
+    vec3 dy = (hasUp && (!hasDown || std::abs(up.z - center.z) < std::abs(center.z - down.z))) ? up - center : center - down;
+    vec3 normal = cross(dx, dy).normalize();
+    // 朝向相机 相机在view空间原点
+    return normal * center > 0.f ? -1.f * normal : normal;
+}
+
+// 对某一方向上的occlusion进行积分
+float HBAOPass::IntegrateDir(const vec3& originNDC, const vec3& originView, const vec3& normal, const vec2& dir) const {
+    float totalOcclusion = 0.f;
+    float topSin = 0.03f;     // 记录积分开始的片段 从非零开始意味着忽略sinθ小于0.03的遮挡
+
+    // 屏幕上的方向在切平面上的投影 偏移一个像素时保持深度不变 不会采到背景
+    vec2 texelSizeStep = mul(dir, vec2(2.f / m_Width, 2.f / m_Height));
+    vec3 tangent = CoordNDCToView(*m_Uniforms, vec3(originNDC.x + texelSizeStep.x, originNDC.y + texelSizeStep.y, originNDC.z), 0) - originView;
+    tangent = (tangent - (normal * tangent) * normal).normalize();
+    vec2 stepNDC = (m_SampleRadius / m_SampleCount) * dir;
+
+    // begin march
+    vec2 curNDC = proj<2>(originNDC);
+    for (int i = 0; i < m_SampleCount; ++i) {
+        curNDC = curNDC + stepNDC;
+        // 校验NDC是否在合法范围内
+        if (curNDC.x < -1 || curNDC.x >= 1 || curNDC.y < -1 || curNDC.y >= 1) {
+            break;
+        }
+        vec3 sampleView;
+        if (!SampleView((0.5f * curNDC.x + 0.5f) * m_Width, (0.5f * curNDC.y + 0.5f) * m_Height, sampleView)) {
+            continue;
+        }
+
+        vec3 horizonVec = sampleView - originView;
+        float horizonVecLength = horizonVec.norm();
+        if (horizonVecLength <= 0.f) {
+            continue;
+        }
+
+        // 这个方向的ambient被完全遮住
+        if (tangent * horizonVec < 0) {
+            return 1.f;
+        }
+        float curSin = normal * horizonVec / horizonVecLength; // sinθ
+        float diff = std::max(curSin - topSin, 0.f);
+        topSin = std::max(topSin, curSin);
+
+        float w = clamp01((float)i / m_SampleCount);
+        totalOcclusion += diff * (1.f - w * w);
+    }
+
+    return totalOcclusion;
+}
+
+// interleaved gradient noise 相邻像素的值相差很大 少量方向的噪点在上采样和时域累积后更容易被抹平
+// 每帧平移一次 同一个像素在连续几帧中取到不同的旋转
+float HBAOPass::InterleavedGradientNoise(int x, int y) const {
+    float fx = x + 5.588238f * (m_Frame % 64);
+    float fy = y + 5.588238f * (m_Frame % 64);
+    float f = 0.06711056f * fx + 0.00583715f * fy;
+    f = 52.9829189f * (f - std::floor(f));
+    return f - std::floor(f);
+}
+
+float HBAOPass::ComputeAO(int x, int y, const vec3& center, float noise) const {
+    vec3 normal = ReconstructNormal(x, y, center);
+    vec3 originNDC(2.f * x / m_Width - 1.f, 2.f * y / m_Height - 1.f, m_Zbuffer[(x + y * m_Width) * m_DepthSamples]);
+
+    // 开始旋转采样
+    float totalAO = 0.f;        // 环境光被阻挡的部分
+    float rotationStep = 2 * PI / m_DirCount;
+    float angle = noise * rotationStep;
+    for (int i = 0; i < m_DirCount; ++i, angle += rotationStep) {
+        vec2 dir(std::cos(angle), std::sin(angle));
+        // 乘上rotationStep是为了计算球面积分的dθ部分 对上半部经度积分后 再对纬度积分
+        totalAO += rotationStep * IntegrateDir(originNDC, center, normal, dir);
+    }
+    return clamp01(1.f - 1.f / (2.f * PI) * totalAO);   // 1/2pi 系数是归一化半球面积分 半球面积为1/2pi
+}
+
+// 把当前帧view空间的点变换到上一帧的低分辨率AO上 取最近的样本
+// 上一帧这里没有物体 或者深度对不上(被遮挡 物体移动)时返回false
+bool HBAOPass::Reproject(const vec3& view, float& history) const {
+    vec4 world = m_Uniforms->vInverseMatrix * embed<4>(view);
+    vec4 prevClip = m_PrevVP * world;
+    if (prevClip.w == 0.f) {
+        return false;
+    }
+    float prevX = (0.5f * prevClip.x / prevClip.w + 0.5f) * m_Width;
+    float prevY = (0.5f * prevClip.y / prevClip.w + 0.5f) * m_Height;
+    int offset = m_Downsample / 2;
+    int x = (int)std::floor((prevX - offset) / m_Downsample + 0.5f);
+    int y = (int)std::floor((prevY - offset) / m_Downsample + 0.5f);
+    if (x < 0 || x >= m_AOWidth || y < 0 || y >= m_AOHeight) {
+        return false;
+    }
+
+    int idx = x + y * m_AOWidth;
+    float historyDepth = m_HistoryDepth[idx];
+    float prevDepth = (m_PrevView * world).z;
+    if (historyDepth == 0.f || std::abs(historyDepth - prevDepth) > 0.05f * std::abs(prevDepth)) {
+        return false;
+    }
+    history = m_History[idx];
+    return true;
+}
+
+// 取周围4个低分辨率样本 双线性权重再按view空间深度的相对差降权 不让AO渗到深度差很大的物体上
+// 在Execute交换buffer之后调用 这时m_History里是这一帧累积后的结果
+void HBAOPass::Upsample(ColorBuffer* aoMap) const {
+    QRgb* out = aoMap->Data();
+    int offset = m_Downsample / 2;
+    float invDownsample = 1.f / m_Downsample;
+#pragma omp parallel for
+    for (int y = 0; y < m_Height; ++y) {
+        float fy = std::max(0.f, (y - offset) * invDownsample);
+        int y0 = std::min((int)fy, m_AOHeight - 1), y1 = std::min(y0 + 1, m_AOHeight - 1);
+        float ty = fy - y0;
+        for (int x = 0; x < m_Width; ++x) {
+            float ao = 1.f;
+            float z = m_Zbuffer[(x + y * m_Width) * m_DepthSamples];
+            if (z >= 0.f) {
+                float viewDepth = CoordNDCToView(*m_Uniforms, vec3(0.f, 0.f, z), 0).z;
+                float fx = std::max(0.f, (x - offset) * invDownsample);
+                int x0 = std::min((int)fx, m_AOWidth - 1), x1 = std::min(x0 + 1, m_AOWidth - 1);
+                float tx = fx - x0;
+
+                const int idx[4] = {x0 + y0 * m_AOWidth, x1 + y0 * m_AOWidth, x0 + y1 * m_AOWidth, x1 + y1 * m_AOWidth};
+                const float bilinear[4] = {(1 - tx) * (1 - ty), tx * (1 - ty), (1 - tx) * ty, tx * ty};
+                float sum = 0.f, weightSum = 0.f;
+                for (int i = 0; i < 4; ++i) {
+                    float sampleDepth = m_HistoryDepth[idx[i]];
+                    if (sampleDepth == 0.f) {
+                        continue;
+                    }
+                    float w = (bilinear[i] + 1e-3f) / (1e-2f + std::abs(sampleDepth - viewDepth) / std::abs(viewDepth));
+                    sum += w * m_History[idx[i]];
+                    weightSum += w;
+                }
+                if (weightSum > 0.f) {
+                    ao = sum / weightSum;
+                }
+            }
+            uint8_t grey = ao * 255;
+            out[x + y * m_Width] = (255 << 24) | (grey << 16) | (grey << 8) | grey;
+        }
+    }
+}
+
+void HBAOPass::Execute(const DepthBuffer* depth, const ShaderUniforms& uniforms, ColorBuffer* aoMap) {
+    m_Zbuffer = depth->Data();
+    m_DepthSamples = depth->Samples();
+    m_Uniforms = &uniforms;
+
+    int tileCountX = (m_AOWidth + TILE_SIZE - 1) / TILE_SIZE;
+    int tileCountY = (m_AOHeight + TILE_SIZE - 1) / TILE_SIZE;
+#pragma omp parallel for schedule(dynamic)
+    for (int tile = 0; tile < tileCountX * tileCountY; ++tile) {
+        int minX = (tile % tileCountX) * TILE_SIZE, maxX = std::min(minX + TILE_SIZE, m_AOWidth);
+        int minY = (tile / tileCountX) * TILE_SIZE, maxY = std::min(minY + TILE_SIZE, m_AOHeight);
+        for (int y = minY; y < maxY; ++y) {
+            for (int x = minX; x < maxX; ++x) {
+                // 低分辨率像素取它覆盖的区域中间的那个全分辨率像素
+                int fullX = std::min(x * m_Downsample + m_Downsample / 2, m_Width - 1);
+                int fullY = std::min(y * m_Downsample + m_Downsample / 2, m_Height - 1);
+                int idx = x + y * m_AOWidth;
+                vec3 center;
+                if (!SampleView(fullX, fullY, center)) {
+                    m_AO[idx] = 1.f;
+                    m_ViewDepth[idx] = 0.f;
+                    continue;
+                }
+                float ao = ComputeAO(fullX, fullY, center, InterleavedGradientNoise(x, y));
+                // 和重投影得到的历史值做指数滑动平均 历史无效时只用当前帧
+                float history;
+                if (m_HistoryValid && Reproject(center, history)) {
+                    ao = history + m_TemporalBlend * (ao - history);
+                }
+                m_AO[idx] = ao;
+                m_ViewDepth[idx] = center.z;
+            }
+        }
+    }
+
+    // 这一帧的结果作为下一帧的历史
+    m_History.swap(m_AO);
+    m_HistoryDepth.swap(m_ViewDepth);
+    m_PrevView = uniforms.viewMatrix;
+    m_PrevVP = uniforms.vpMatrix;
+    m_HistoryValid = true;
+    ++m_Frame;
+
+    // 整张AO map都会被覆盖 不需要先按tile填清空值
+    aoMap->MarkWritten();
+    Upsample(aoMap);
+}
+
+void MSAAResolvePass::Execute(const ColorBuffer* msaa, ColorBuffer* out) {
+    int samples = msaa->Samples();
+    int count = msaa->Width() * msaa->Height();
+    if (msaa->GetFormat() == ColorBuffer::FORMAT_RGBA32F) {
+        const float* src = msaa->HDRData();
+        float* dst = out->HDRData();
+#pragma omp parallel for
+        for (int i = 0; i < count; ++i) {
+            Pixel4 sum = Zero4();
+            float weightSum = 0.f;
+            for (int s = 0; s < samples; ++s) {
+                const float* c = src + 4 * (i * samples + s);
+                float w = 1.f / (1.f + std::max(c[0], std::max(c[1], c[2])));
+                sum = Add4(sum, Mul4(Load4(c), w));
+                weightSum += w;
+            }
+            Store4(dst + 4 * i, Mul4(sum, 1.f / weightSum));
+        }
+    }
+    else {
+        const QRgb* src = msaa->Data();
+        QRgb* dst = out->Data();
+#pragma omp parallel for
+        for (int i = 0; i < count; ++i) {
+            int sum[4] = {0, 0, 0, 0};
+            for (int s = 0; s < samples; ++s) {
+                QRgb c = src[i * samples + s];
+                for (int j = 0; j < 4; ++j) {
+                    sum[j] += (c >> (8 * j)) & 0xff;
+                }
+            }
+            QRgb color = 0;
+            for (int j = 0; j < 4; ++j) {
+                color |= (QRgb)((sum[j] + samples / 2) / samples) << (8 * j);
+            }
+            dst[i] = color;
+        }
+    }
+    out->MarkWritten();
+}
+
+BloomPass::BloomPass(int width, int height, float threshold, float intensity) :
+    m_Width(width), m_Height(height), m_Threshold(threshold), m_Intensity(intensity)
+{
+    m_HalfWidth = (width + 1) / 2;
+    m_HalfHeight = (height + 1) / 2;
+    m_Bright.resize(4 * m_HalfWidth * m_HalfHeight);
+    m_Blur.resize(4 * m_HalfWidth * m_HalfHeight);
+
+    // sigma取半径的一半 归一化后两侧的权重和加中心为1
+    float sigma = BLUR_RADIUS * 0.5f, sum = 0.f;
+    for (int i = 0; i <= BLUR_RADIUS; ++i) {
+        m_Weights[i] = std::exp(-0.5f * i * i / (sigma * sigma));
+        sum += i == 0 ? m_Weights[i] : 2.f * m_Weights[i];
+    }
+    for (int i = 0; i <= BLUR_RADIUS; ++i) {
+        m_Weights[i] /= sum;
+    }
+}
+
+void BloomPass::Execute(ColorBuffer* hdr) {
+    float* color = hdr->HDRData();
+
+    // 2x2降采样 只保留超过阈值的部分 按最亮通道等比例缩放 不改变色相
+#pragma omp parallel for
+    for (int y = 0; y < m_HalfHeight; ++y) {
+        int y0 = std::min(2 * y, m_Height - 1), y1 = std::min(2 * y + 1, m_Height - 1);
+        for (int x = 0; x < m_HalfWidth; ++x) {
+            int x0 = std::min(2 * x, m_Width - 1), x1 = std::min(2 * x + 1, m_Width - 1);
+            Pixel4 sum = Add4(Add4(Load4(color + 4 * (x0 + y0 * m_Width)), Load4(color + 4 * (x1 + y0 * m_Width))),
+                              Add4(Load4(color + 4 * (x0 + y1 * m_Width)), Load4(color + 4 * (x1 + y1 * m_Width))));
+            sum = Mul4(sum, 0.25f);
+            float rgba[4];
+            Store4(rgba, sum);
+            float brightness = std::max(rgba[0], std::max(rgba[1], rgba[2]));
+            float contribution = brightness > m_Threshold ? (brightness - m_Threshold) / brightness : 0.f;
+            Store4(&m_Bright[4 * (x + y * m_HalfWidth)], Mul4(sum, contribution));
+        }
+    }
+
+    // 可分离高斯模糊 横向m_Bright->m_Blur 纵向m_Blur->m_Bright 边界外取边界像素
+#pragma omp parallel for
+    for (int y = 0; y < m_HalfHeight; ++y) {
+        const float* row = &m_Bright[4 * y * m_HalfWidth];
+        for (int x = 0; x < m_HalfWidth; ++x) {
+            Pixel4 sum = Mul4(Load4(row + 4 * x), m_Weights[0]);
+            for (int i = 1; i <= BLUR_RADIUS; ++i) {
+                int left = std::max(x - i, 0), right = std::min(x + i, m_HalfWidth - 1);
+                sum = Add4(sum, Mul4(Add4(Load4(row + 4 * left), Load4(row + 4 * right)), m_Weights[i]));
+            }
+            Store4(&m_Blur[4 * (x + y * m_HalfWidth)], sum);
+        }
+    }
+#pragma omp parallel for
+    for (int y = 0; y < m_HalfHeight; ++y) {
+        for (int x = 0; x < m_HalfWidth; ++x) {
+            Pixel4 sum = Mul4(Load4(&m_Blur[4 * (x + y * m_HalfWidth)]), m_Weights[0]);
+            for (int i = 1; i <= BLUR_RADIUS; ++i) {
+                int up = std::max(y - i, 0), down = std::min(y + i, m_HalfHeight - 1);
+                sum = Add4(sum, Mul4(Add4(Load4(&m_Blur[4 * (x + up * m_HalfWidth)]), Load4(&m_Blur[4 * (x + down * m_HalfWidth)])), m_Weights[i]));
+            }
+            Store4(&m_Bright[4 * (x + y * m_HalfWidth)], sum);
+        }
+    }
+
+    // 双线性上采样后叠加回原图 半分辨率像素中心在全分辨率的2x+0.5处
+#pragma omp parallel for
+    for (int y = 0; y < m_Height; ++y) {
+        float fy = std::max(0.f, (y - 0.5f) * 0.5f);
+        int y0 = std::min((int)fy, m_HalfHeight - 1), y1 = std::min(y0 + 1, m_HalfHeight - 1);
+        float ty = fy - y0;
+        for (int x = 0; x < m_Width; ++x) {
+            float fx = std::max(0.f, (x - 0.5f) * 0.5f);
+            int x0 = std::min((int)fx, m_HalfWidth - 1), x1 = std::min(x0 + 1, m_HalfWidth - 1);
+            float tx = fx - x0;
+            Pixel4 top = Add4(Mul4(Load4(&m_Bright[4 * (x0 + y0 * m_HalfWidth)]), 1.f - tx), Mul4(Load4(&m_Bright[4 * (x1 + y0 * m_HalfWidth)]), tx));
+            Pixel4 bottom = Add4(Mul4(Load4(&m_Bright[4 * (x0 + y1 * m_HalfWidth)]), 1.f - tx), Mul4(Load4(&m_Bright[4 * (x1 + y1 * m_HalfWidth)]), tx));
+            Pixel4 bloom = Add4(Mul4(top, 1.f - ty), Mul4(bottom, ty));
+            float* dst = color + 4 * (x + y * m_Width);
+            Store4(dst, Add4(Load4(dst), Mul4(bloom, m_Intensity)));
+        }
+    }
+}
+
+ToneMapPass::ToneMapPass(float exposure) : m_Exposure(exposure) {
+    for (int i = 0; i < LUT_SIZE; ++i) {
+        float v = (float)i / (LUT_SIZE - 1);
+        float srgb = v <= 0.0031308f ? 12.92f * v : 1.055f * std::pow(v, 1.f / 2.4f) - 0.055f;
+        m_SRGBLut[i] = (uint8_t)(clamp01(srgb) * 255.f + 0.5f);
+    }
+}
+
+void ToneMapPass::Execute(const ColorBuffer* hdr, ColorBuffer* ldr) {
+    const float* src = hdr->HDRData();
+    QRgb* dst = ldr->Data();
+    int width = hdr->Width(), height = hdr->Height();
+    int tileCountX = (width + ColorBuffer::TILE_SIZE - 1) / ColorBuffer::TILE_SIZE;
+    int tileCountY = (height + ColorBuffer::TILE_SIZE - 1) / ColorBuffer::TILE_SIZE;
+    float exposure = m_Exposure;
+
+#pragma omp parallel for
+    for (int tile = 0; tile < tileCountX * tileCountY; ++tile) {
+        int minX = (tile % tileCountX) * ColorBuffer::TILE_SIZE, maxX = std::min(minX + ColorBuffer::TILE_SIZE, width);
+        int minY = (tile / tileCountX) * ColorBuffer::TILE_SIZE, maxY = std::min(minY + ColorBuffer::TILE_SIZE, height);
+        for (int y = minY; y < maxY; ++y) {
+            for (int x = minX; x < maxX; ++x) {
+                int idx = x + y * width;
+                // ACES filmic的拟合 (x(2.51x+0.03)) / (x(2.43x+0.59)+0.14)
+                Pixel4 c = Mul4(Load4(src + 4 * idx), exposure);
+                Pixel4 num = Mul4(c, AddScalar4(Mul4(c, 2.51f), 0.03f));
+                Pixel4 den = AddScalar4(Mul4(c, AddScalar4(Mul4(c, 2.43f), 0.59f)), 0.14f);
+                Pixel4 mapped = Mul4(Clamp014(Div4(num, den)), (float)(LUT_SIZE - 1));
+                float rgb[4];
+                Store4(rgb, mapped);
+                dst[idx] = (255 << 24) | (m_SRGBLut[(int)(rgb[0] + 0.5f)] << 16) | (m_SRGBLut[(int)(rgb[1] + 0.5f)] << 8) | m_SRGBLut[(int)(rgb[2] + 0.5f)];
+            }
+        }
+    }
+    ldr->MarkWritten();
+}
+
+FXAAPass::FXAAPass(int width, int height, float edgeThreshold, float edgeThresholdMin) :
+    m_Width(width), m_Height(height), m_EdgeThreshold(edgeThreshold), m_EdgeThresholdMin(edgeThresholdMin)
+{
+    m_Luma.resize(width * height);
+}
+
+vec3 FXAAPass::SampleBilinear(const QRgb* src, float x, float y) const {
+    x = std::min(std::max(x, 0.f), m_Width - 1.f);
+    y = std::min(std::max(y, 0.f), m_Height - 1.f);
+    int x0 = (int)x, y0 = (int)y;
+    int x1 = std::min(x0 + 1, m_Width - 1), y1 = std::min(y0 + 1, m_Height - 1);
+    float tx = x - x0, ty = y - y0;
+    const QRgb corners[4] = {src[x0 + y0 * m_Width], src[x1 + y0 * m_Width], src[x0 + y1 * m_Width], src[x1 + y1 * m_Width]};
+    const float weights[4] = {(1 - tx) * (1 - ty), tx * (1 - ty), (1 - tx) * ty, tx * ty};
+    vec3 ret(0, 0, 0);
+    for (int i = 0; i < 4; ++i) {
+        ret = ret + weights[i] * vec3((corners[i] >> 16) & 0xff, (corners[i] >> 8) & 0xff, corners[i] & 0xff);
+    }
+    return ret;
+}
+
+// FXAA 2的做法 用四个对角的亮度估计边缘的法线方向 沿切线方向取两组样本 第二组超出局部亮度范围时退回第一组
+void FXAAPass::Execute(const ColorBuffer* ldr, ColorBuffer* out) {
+    const QRgb* src = ldr->Data();
+    QRgb* dst = out->Data();
+    const float REDUCE_MIN = 1.f / 128.f, REDUCE_MUL = 1.f / 8.f, SPAN_MAX = 8.f;
+
+#pragma omp parallel for
+    for (int i = 0; i < m_Width * m_Height; ++i) {
+        QRgb c = src[i];
+        m_Luma[i] = (0.299f * ((c >> 16) & 0xff) + 0.587f * ((c >> 8) & 0xff) + 0.114f * (c & 0xff)) / 255.f;
+    }
+
+#pragma omp parallel for schedule(dynamic, 8)
+    for (int y = 0; y < m_Height; ++y) {
+        int up = std::max(y - 1, 0), down = std::min(y + 1, m_Height - 1);
+        for (int x = 0; x < m_Width; ++x) {
+            int left = std::max(x - 1, 0), right = std::min(x + 1, m_Width - 1);
+            float lumaM = m_Luma[x + y * m_Width];
+            float lumaNW = m_Luma[left + up * m_Width], lumaNE = m_Luma[right + up * m_Width];
+            float lumaSW = m_Luma[left + down * m_Width], lumaSE = m_Luma[right + down * m_Width];
+            float lumaMin = std::min(lumaM, std::min(std::min(lumaNW, lumaNE), std::min(lumaSW, lumaSE)));
+            float lumaMax = std::max(lumaM, std::max(std::max(lumaNW, lumaNE), std::max(lumaSW, lumaSE)));
+
+            // 大部分像素对比度很低 直接拷贝
+            if (lumaMax - lumaMin < std::max(m_EdgeThresholdMin, lumaMax * m_EdgeThreshold)) {
+                dst[x + y * m_Width] = src[x + y * m_Width];
+                continue;
+            }
+
+            vec2 dir(-((lumaNW + lumaNE) - (lumaSW + lumaSE)), (lumaNW + lumaSW) - (lumaNE + lumaSE));
+            float dirReduce = std::max((lumaNW + lumaNE + lumaSW + lumaSE) * 0.25f * REDUCE_MUL, REDUCE_MIN);
+            float rcpDirMin = 1.f / (std::min(std::abs(dir.x), std::abs(dir.y)) + dirReduce);
+            dir.x = std::min(SPAN_MAX, std::max(-SPAN_MAX, dir.x * rcpDirMin));
+            dir.y = std::min(SPAN_MAX, std::max(-SPAN_MAX, dir.y * rcpDirMin));
+
+            vec3 rgbA = 0.5f * (SampleBilinear(src, x + dir.x * (1.f / 3.f - 0.5f), y + dir.y * (1.f / 3.f - 0.5f)) +
+                                SampleBilinear(src, x + dir.x * (2.f / 3.f - 0.5f), y + dir.y * (2.f / 3.f - 0.5f)));
+            vec3 rgbB = 0.5f * rgbA + 0.25f * (SampleBilinear(src, x - dir.x * 0.5f, y - dir.y * 0.5f) +
+                                               SampleBilinear(src, x + dir.x * 0.5f, y + dir.y * 0.5f));
+            float lumaB = (0.299f * rgbB.x + 0.587f * rgbB.y + 0.114f * rgbB.z) / 255.f;
+            vec3 rgb = (lumaB < lumaMin || lumaB > lumaMax) ? rgbA : rgbB;
+            dst[x + y * m_Width] = (255 << 24) | ((uint8_t)(rgb.x + 0.5f) << 16) | ((uint8_t)(rgb.y + 0.5f) << 8) | (uint8_t)(rgb.z + 0.5f);
+        }
+    }
+    out->MarkWritten();
+}
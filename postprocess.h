@@ -0,0 +1,122 @@
+#ifndef POSTPROCESS_H
+#define POSTPROCESS_H
+
+#include <vector>
+#include <cstdint>
+#include "geometry.h"
+#include "shader.h"
+#include "depthbuffer.h"
+#include "colorbuffer.h"
+
+/* 屏幕空间的后处理pass 不经过光栅化器 直接读写整张buffer
+ * 按tile用OpenMP并行 开销只和像素数有关 和场景的三角形数无关
+ */
+
+/* horizon-based AO
+ * 只用深度prepass的结果: 由深度重建view空间位置和法线 在降采样后的分辨率上沿若干方向步进找地平线
+ * 再按深度做双边上采样 写回全分辨率的AO map(灰度 和原来HBAOShader的输出格式相同)
+ * 每个像素的方向旋转取interleaved gradient noise 每帧换一组 结果按上一帧的相机矩阵重投影后做时域累积
+ * 所以每帧只需要很少的方向 静止的画面几帧之后相当于用了多组旋转
+ */
+class HBAOPass {
+public:
+    static const int TILE_SIZE = 32;        // 低分辨率下一个并行任务的大小 px
+
+private:
+    int m_Width, m_Height;                  // 全分辨率
+    int m_Downsample;                       // 1 2 4
+    int m_AOWidth, m_AOHeight;              // 降采样后的分辨率
+    float m_SampleRadius;                   // 采样半径(ndc)
+    int m_SampleCount, m_DirCount;          // 每个方向的采样数目 每帧的方向数目
+    float m_TemporalBlend;                  // 当前帧在时域累积中的权重 1为不累积
+    std::vector<float> m_AO;                // 低分辨率的AO 1为完全不遮挡
+    std::vector<float> m_ViewDepth;         // 低分辨率像素对应的view空间深度 没有物体时为0 上采样和重投影时比较用
+
+    // 上一帧的结果 Execute结束时和m_AO m_ViewDepth交换
+    std::vector<float> m_History;
+    std::vector<float> m_HistoryDepth;
+    mat4x4 m_PrevView, m_PrevVP;            // 上一帧相机的view矩阵和vp矩阵
+    bool m_HistoryValid = false;
+    unsigned m_Frame = 0;
+
+    const float* m_Zbuffer = nullptr;       // 本次Execute的深度
+    int m_DepthSamples = 1;                 // 多重采样的深度只读每个像素的第0个采样点
+    const ShaderUniforms* m_Uniforms = nullptr;
+
+    bool SampleView(int x, int y, vec3& view) const;          // 全分辨率像素的view空间位置 没有物体时返回false
+    vec3 ReconstructNormal(int x, int y, const vec3& center) const;
+    float IntegrateDir(const vec3& originNDC, const vec3& originView, const vec3& normal, const vec2& dir) const;
+    float InterleavedGradientNoise(int x, int y) const;       // [0, 1)
+    float ComputeAO(int x, int y, const vec3& center, float noise) const;    // 全分辨率像素(x, y)处的环境光 center是它的view空间位置
+    bool Reproject(const vec3& view, float& history) const;
+    void Upsample(ColorBuffer* aoMap) const;
+
+public:
+    HBAOPass(int width, int height, int downsample = 2, float sampleRadius = 0.2f, int sampleCount = 5, int dirCount = 3,
+             float temporalBlend = 0.2f);
+    void ResetHistory() { m_HistoryValid = false; }     // 画面突变(切换场景 改分辨率)时丢掉时域累积
+
+    // depth需要已经Resolve uniforms是生成depth时相机的uniform
+    void Execute(const DepthBuffer* depth, const ShaderUniforms& uniforms, ColorBuffer* aoMap);
+};
+
+/* 浮点颜色(FORMAT_RGBA32F)到最终显示之间的后处理链 (MSAA resolve) -> bloom -> tone mapping + sRGB -> FXAA
+ * 每个像素的rgba正好是一个SSE寄存器 逐像素的运算一次处理4个通道
+ */
+
+/* 把多重采样的颜色合成单采样 两边格式相同
+ * 浮点颜色按1/(1+亮度)加权平均再除回去 边缘上很亮的采样点不会把整个像素拉亮 否则tone mapping后边缘又会出现锯齿
+ */
+class MSAAResolvePass {
+public:
+    void Execute(const ColorBuffer* msaa, ColorBuffer* out);   // msaa需要已经Resolve 写满整个out
+};
+
+/* 亮部提取后在半分辨率上做可分离高斯模糊 再叠加回原来的浮点颜色 */
+class BloomPass {
+public:
+    static const int BLUR_RADIUS = 4;       // 半分辨率下的高斯核半径 px
+
+private:
+    int m_Width, m_Height;
+    int m_HalfWidth, m_HalfHeight;
+    float m_Threshold;                      // 亮度超过它的部分才会泛光
+    float m_Intensity;
+    float m_Weights[BLUR_RADIUS + 1];       // 高斯核 m_Weights[0]是中心
+    std::vector<float> m_Bright, m_Blur;    // 半分辨率 每个像素4个float
+
+public:
+    BloomPass(int width, int height, float threshold = 1.f, float intensity = 0.3f);
+    void Execute(ColorBuffer* hdr);         // hdr需要已经Resolve 结果叠加回hdr
+};
+
+/* ACES曝光映射到[0, 1] 再查表做sRGB编码 打包成QRgb */
+class ToneMapPass {
+public:
+    static const int LUT_SIZE = 4096;       // 线性值[0, 1]均匀分成LUT_SIZE份 足够区分8bit sRGB的暗部
+
+private:
+    float m_Exposure;
+    uint8_t m_SRGBLut[LUT_SIZE];
+
+public:
+    ToneMapPass(float exposure = 1.f);
+    void SetExposure(float exposure) { m_Exposure = exposure; }
+    void Execute(const ColorBuffer* hdr, ColorBuffer* ldr);     // hdr需要已经Resolve 写满整个ldr
+};
+
+/* 在tone mapping之后的8bit颜色上做FXAA 按亮度对比度找边缘 沿边缘方向混合 */
+class FXAAPass {
+    int m_Width, m_Height;
+    float m_EdgeThreshold;                  // 相对对比度低于它的像素不处理
+    float m_EdgeThresholdMin;               // 暗部的绝对对比度阈值
+    std::vector<float> m_Luma;
+
+    vec3 SampleBilinear(const QRgb* src, float x, float y) const;     // 像素中心在整数坐标
+
+public:
+    FXAAPass(int width, int height, float edgeThreshold = 0.125f, float edgeThresholdMin = 0.0312f);
+    void Execute(const ColorBuffer* ldr, ColorBuffer* out);    // ldr需要已经Resolve 写满整个out
+};
+
+#endif // POSTPROCESS_H
@@ -0,0 +1,898 @@
+#include "rasterizer.h"
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#ifdef RASTER_SSE2
+#include <emmintrin.h>
+#endif
+
+static_assert(Rasterizer::BLOCK_SIZE == FRAGMENT_BATCH_SIZE, "8x8块的一行正好是一次FragmentBatch");
+
+// 4x MSAA的旋转网格采样点 相对像素中心 以1/16像素为单位 任意横线竖线上都只有一个采样点
+static const int SAMPLE_OFFSETS[Rasterizer::MSAA_SAMPLES][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+static const int SAMPLE_EXTENT = 6;     // 采样点离像素中心最远的距离 包围盒按它向外扩
+
+Rasterizer::Rasterizer(int width, int height) : m_Width(width), m_Height(height) {
+    m_TileCountX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    m_TileCountY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    m_Bins.resize(m_TileCountX * m_TileCountY);
+
+    // guard band在屏幕上的总宽度不超过FIXED_MAX_EXTENT 保证裁剪后的三角形能用定点数光栅化
+    m_GuardBandX = std::max(1.f, (FIXED_MAX_EXTENT - 1.f) / width);
+    m_GuardBandY = std::max(1.f, (FIXED_MAX_EXTENT - 1.f) / height);
+}
+
+void Rasterizer::Begin(IShader* shader, ColorBuffer* renderTarget, DepthBuffer* depth, const RenderState& state) {
+    BeginDraw(shader, renderTarget, depth, state);
+    m_RasterizeTile = &Rasterizer::RasterizeTile<IShader>;
+}
+
+void Rasterizer::BeginDraw(IShader* shader, ColorBuffer* renderTarget, DepthBuffer* depth, const RenderState& state) {
+    m_Shader = shader;
+    m_State = state;
+    m_Samples = depth->Samples();
+    // visibility buffer每个像素只有一个三角形 多重采样时退回forward
+    if (m_Samples > 1) {
+        m_State.deferred = false;
+    }
+    if (m_State.deferred) {
+        m_Visibility.resize(m_Width * m_Height);
+    }
+    m_Color = renderTarget;
+    m_RenderTarget = renderTarget != nullptr ? renderTarget->Data() : nullptr;
+    m_HDRTarget = renderTarget != nullptr ? renderTarget->HDRData() : nullptr;
+    m_DepthOnly = renderTarget == nullptr && !m_State.deferred && shader->DepthOnly();
+    m_Depth = depth;
+    m_Zbuffer = depth->Data();
+    m_Triangles.clear();
+    m_Varyings.clear();
+}
+
+bool Rasterizer::Cull(const vec4* clipPts) {
+    ++m_Stats.submitted;
+
+    // 视锥outcode: bit0~5分别表示在 x=-w x=w y=-w y=w 近平面 远平面 的外侧
+    int outcodes[3];
+    for (int i = 0; i < 3; ++i) {
+        const vec4& p = clipPts[i];
+        outcodes[i] = (p.x < -p.w) | ((p.x > p.w) << 1) | ((p.y < -p.w) << 2) | ((p.y > p.w) << 3) |
+                      ((p.z > p.w) << 4) | ((p.z < 0.f) << 5);
+    }
+    // 三个顶点都在同一个面的外侧 三角形完全在视锥外
+    if (outcodes[0] & outcodes[1] & outcodes[2]) {
+        ++m_Stats.frustumCulled;
+        return true;
+    }
+    if (IsFaceCulled(clipPts)) {
+        ++m_Stats.backfaceCulled;
+        return true;
+    }
+    return false;
+}
+
+void Rasterizer::Submit(const vec4* clipPts, const void* const* varyings) {
+    // 只有跨过近平面或guard band的三角形才需要裁剪
+    int planeMask = 0;
+    for (int i = 0; i < 3; ++i) {
+        for (int plane = 0; plane < CLIP_PLANE_COUNT; ++plane) {
+            if (PlaneDistance(clipPts[i], plane) < 0.f) {
+                planeMask |= 1 << plane;
+            }
+        }
+    }
+
+    if (planeMask == 0) {
+        SetupTriangle(clipPts, varyings);
+    }
+    else {
+        ClipTriangle(clipPts, varyings, planeMask);
+    }
+}
+
+// 齐次空间的行列式|x y w| 符号与屏幕空间有向面积一致 顶点跨过近平面时也成立 所以能在裁剪前做
+bool Rasterizer::IsFaceCulled(const vec4* clipPts) const {
+    if (m_State.cullMode == CULL_NONE) {
+        return false;
+    }
+    const vec4& p0 = clipPts[0];
+    const vec4& p1 = clipPts[1];
+    const vec4& p2 = clipPts[2];
+    float det = p0.x * (p1.y * p2.w - p1.w * p2.y) -
+                p0.y * (p1.x * p2.w - p1.w * p2.x) +
+                p0.w * (p1.x * p2.y - p1.y * p2.x);
+    // 模型以逆时针为正面 投影翻转了y 正面的det > 0
+    return m_State.cullMode == CULL_BACK ? det < 0.f : det > 0.f;
+}
+
+float Rasterizer::PlaneDistance(const vec4& p, int plane) const {
+    switch (plane) {
+    case CLIP_NEAR:             // z/w <= 1 [far, near]->[0, 1]
+        return p.w - p.z;
+    case CLIP_GUARD_LEFT:
+        return m_GuardBandX * p.w + p.x;
+    case CLIP_GUARD_RIGHT:
+        return m_GuardBandX * p.w - p.x;
+    case CLIP_GUARD_TOP:
+        return m_GuardBandY * p.w + p.y;
+    case CLIP_GUARD_BOTTOM:
+        return m_GuardBandY * p.w - p.y;
+    default:
+        return 0.f;
+    }
+}
+
+// Sutherland-Hodgman 依次用planeMask中的面裁剪多边形 最后按扇形拆成三角形
+void Rasterizer::ClipTriangle(const vec4* clipPts, const void* const* varyings, int planeMask) {
+    int nfloat = m_Shader->VaryingSize() / sizeof(float);
+    m_ClipVaryings.resize(2 * MAX_CLIP_VERTS * nfloat);
+
+    // 两组顶点来回倒
+    vec4 pts[2][MAX_CLIP_VERTS];
+    float* vary[2] = {m_ClipVaryings.data(), m_ClipVaryings.data() + MAX_CLIP_VERTS * nfloat};
+    int cur = 0, n = 3;
+    for (int i = 0; i < 3; ++i) {
+        pts[0][i] = clipPts[i];
+        if (nfloat > 0) {
+            std::memcpy(vary[0] + i * nfloat, varyings[i], nfloat * sizeof(float));
+        }
+    }
+
+    for (int plane = 0; plane < CLIP_PLANE_COUNT; ++plane) {
+        if (!(planeMask & (1 << plane))) {
+            continue;
+        }
+        int next = cur ^ 1, m = 0;
+        for (int i = 0; i < n; ++i) {
+            int j = (i + 1) % n;
+            float di = PlaneDistance(pts[cur][i], plane);
+            float dj = PlaneDistance(pts[cur][j], plane);
+            if (di >= 0.f) {
+                pts[next][m] = pts[cur][i];
+                for (int k = 0; k < nfloat; ++k) {
+                    vary[next][m * nfloat + k] = vary[cur][i * nfloat + k];
+                }
+                ++m;
+            }
+            // 边跨过裁剪面 插值出交点
+            if ((di >= 0.f) != (dj >= 0.f)) {
+                float t = di / (di - dj);
+                pts[next][m] = lerp(pts[cur][i], pts[cur][j], t);
+                for (int k = 0; k < nfloat; ++k) {
+                    vary[next][m * nfloat + k] = (1.f - t) * vary[cur][i * nfloat + k] + t * vary[cur][j * nfloat + k];
+                }
+                ++m;
+            }
+        }
+        cur = next;
+        n = m;
+        if (n < 3) {
+            return;
+        }
+    }
+
+    for (int i = 1; i + 1 < n; ++i) {
+        vec4 triPts[3] = {pts[cur][0], pts[cur][i], pts[cur][i + 1]};
+        const void* triVaryings[3] = {vary[cur], vary[cur] + i * nfloat, vary[cur] + (i + 1) * nfloat};
+        SetupTriangle(triPts, triVaryings);
+    }
+}
+
+void Rasterizer::SetupTriangle(const vec4* clipPts, const void* const* varyings) {
+    TriangleSetup tri;
+    for (int i = 0; i < 3; ++i) {
+        tri.clipPts[i] = clipPts[i];
+        tri.screenPts[i] = vec2((0.5f * (clipPts[i].x / clipPts[i].w) + 0.5f) * m_Width,
+                                (0.5f * (clipPts[i].y / clipPts[i].w) + 0.5f) * m_Height);
+    }
+
+    // 屏幕包围盒 完全在屏幕外的三角形直接丢掉
+    float minX = std::min(tri.screenPts[0].x, std::min(tri.screenPts[1].x, tri.screenPts[2].x));
+    float minY = std::min(tri.screenPts[0].y, std::min(tri.screenPts[1].y, tri.screenPts[2].y));
+    float maxX = std::max(tri.screenPts[0].x, std::max(tri.screenPts[1].x, tri.screenPts[2].x));
+    float maxY = std::max(tri.screenPts[0].y, std::max(tri.screenPts[1].y, tri.screenPts[2].y));
+    // 多重采样时像素中心在三角形外也可能有采样点被盖住
+    float margin = m_Samples > 1 ? (float)SAMPLE_EXTENT / SUBPIXEL_SCALE : 0.f;
+    tri.minX = (int)std::max(0.f, minX - margin);
+    tri.minY = (int)std::max(0.f, minY - margin);
+    tri.maxX = (int)std::min(m_Width - 1.f, maxX + margin);
+    tri.maxY = (int)std::min(m_Height - 1.f, maxY + margin);
+    if (tri.minX > tri.maxX || tri.minY > tri.maxY) {
+        ++m_Stats.frustumCulled;
+        return;
+    }
+
+    // 裁剪后顶点都在相机前方 包围盒不超过guard band时用定点数边方程 退化三角形直接丢掉
+    tri.fixedPoint = maxX - minX <= FIXED_MAX_EXTENT && maxY - minY <= FIXED_MAX_EXTENT;
+    if (tri.fixedPoint) {
+        if (!SetupEdges(tri)) {
+            ++m_Stats.degenerateCulled;
+            return;
+        }
+        // 屏幕空间中z/w是线性的 三角形内的深度不会超出三个顶点的范围
+        tri.minZ = std::min(tri.ndcZ[0], std::min(tri.ndcZ[1], tri.ndcZ[2]));
+        tri.maxZ = std::max(tri.ndcZ[0], std::max(tri.ndcZ[1], tri.ndcZ[2]));
+    }
+    else {
+        tri.minZ = MIN;
+        tri.maxZ = MAX;
+    }
+
+    // 分箱 tile内已有的深度全都比三角形近时不用进箱 一个tile都没进说明整个三角形被挡住了
+    int triIdx = m_Triangles.size();
+    bool binned = false;
+    for (int ty = tri.minY / TILE_SIZE; ty <= tri.maxY / TILE_SIZE; ++ty) {
+        for (int tx = tri.minX / TILE_SIZE; tx <= tri.maxX / TILE_SIZE; ++tx) {
+            if (tri.maxZ < m_Depth->TileMin(tx, ty)) {
+                continue;
+            }
+            m_Bins[ty * m_TileCountX + tx].push_back(triIdx);
+            binned = true;
+        }
+    }
+    if (!binned) {
+        ++m_Stats.occludedCulled;
+        return;
+    }
+
+    // 保存varying 调用者传入的顶点数据在Submit返回后可能被下一个三角形覆盖
+    int varyingSize = m_Shader->VaryingSize();
+    tri.varyingOffset = m_Varyings.size();
+    if (varyingSize > 0) {
+        m_Varyings.resize(m_Varyings.size() + 3 * varyingSize);
+        for (int i = 0; i < 3; ++i) {
+            std::memcpy(&m_Varyings[tri.varyingOffset + i * varyingSize], varyings[i], varyingSize);
+        }
+    }
+    m_Triangles.push_back(tri);
+}
+
+bool Rasterizer::SetupEdges(TriangleSetup& tri) {
+    int X[3], Y[3];
+    for (int i = 0; i < 3; ++i) {
+        X[i] = (int)std::lround(tri.screenPts[i].x * SUBPIXEL_SCALE);
+        Y[i] = (int)std::lround(tri.screenPts[i].y * SUBPIXEL_SCALE);
+    }
+
+    // 有向面积的两倍 = E_0(P0)
+    long long area = (long long)(X[2] - X[1]) * (Y[0] - Y[1]) - (long long)(Y[2] - Y[1]) * (X[0] - X[1]);
+    if (area == 0) {
+        return false;
+    }
+
+    // 像素中心在整数坐标上 吸附后的包围盒内没有像素中心的细小三角形不会盖住任何像素
+    // 顺便把包围盒收紧到像素中心 左上角向上取整 多重采样时包围盒先向外扩到采样点能到的范围
+    int margin = m_Samples > 1 ? SAMPLE_EXTENT : 0;
+    int minX = (std::min(X[0], std::min(X[1], X[2])) - margin + SUBPIXEL_SCALE - 1) >> SUBPIXEL_BITS;
+    int minY = (std::min(Y[0], std::min(Y[1], Y[2])) - margin + SUBPIXEL_SCALE - 1) >> SUBPIXEL_BITS;
+    int maxX = (std::max(X[0], std::max(X[1], X[2])) + margin) >> SUBPIXEL_BITS;
+    int maxY = (std::max(Y[0], std::max(Y[1], Y[2])) + margin) >> SUBPIXEL_BITS;
+    tri.minX = std::max(tri.minX, minX);
+    tri.minY = std::max(tri.minY, minY);
+    tri.maxX = std::min(tri.maxX, maxX);
+    tri.maxY = std::min(tri.maxY, maxY);
+    if (tri.minX > tri.maxX || tri.minY > tri.maxY) {
+        return false;
+    }
+    // 统一成三角形内部E_i >= 0 这样不管顶点顺时针还是逆时针都能用同一套测试
+    int sign = area > 0 ? 1 : -1;
+
+    for (int i = 0; i < 3; ++i) {
+        int j = (i + 1) % 3, k = (i + 2) % 3;
+        // E_i(P) = cross(Pk - Pj, P - Pj)
+        int a = -(Y[k] - Y[j]) * sign;
+        int b = (X[k] - X[j]) * sign;
+        tri.edgeC[i] = -(long long)a * X[j] - (long long)b * Y[j];
+        tri.stepX[i] = a * SUBPIXEL_SCALE;
+        tri.stepY[i] = b * SUBPIXEL_SCALE;
+        // 落在边上的像素: 公共边在两个三角形中(a, b)正好相反 所以只有一个三角形会包含它
+        tri.bias[i] = (a > 0 || (a == 0 && b > 0)) ? 0 : -1;
+        tri.invW[i] = 1.f / tri.clipPts[i].w;
+        tri.ndcZ[i] = tri.clipPts[i].z * tri.invW[i];
+    }
+    tri.invArea = 1.f / (float)(area * sign);
+    return true;
+}
+
+void Rasterizer::Flush() {
+    int tileCount = m_TileCountX * m_TileCountY;
+    // tile之间互不重叠 动态调度让覆盖三角形多的tile不会拖住某一个线程
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < tileCount; ++i) {
+        (this->*m_RasterizeTile)(i);
+    }
+
+    for (int i = 0; i < tileCount; ++i) {
+        m_Bins[i].clear();
+    }
+    m_Triangles.clear();
+    m_Varyings.clear();
+}
+
+template<class ShaderT>
+void Rasterizer::RasterizeTile(int tileIdx) {
+    const std::vector<int>& bin = m_Bins[tileIdx];
+    if (bin.empty()) {
+        return;
+    }
+
+    int tileMinX = (tileIdx % m_TileCountX) * TILE_SIZE;
+    int tileMinY = (tileIdx / m_TileCountX) * TILE_SIZE;
+    int tileMaxX = std::min(tileMinX + TILE_SIZE, m_Width) - 1;
+    int tileMaxY = std::min(tileMinY + TILE_SIZE, m_Height) - 1;
+
+    // 第一次写这个tile时才真正清空
+    int tileX = tileIdx % m_TileCountX, tileY = tileIdx / m_TileCountX;
+    m_Depth->MaterializeTile(tileX, tileY);
+    if (m_Color != nullptr) {
+        m_Color->MaterializeTile(tileX, tileY);
+    }
+
+    // visibility buffer只在本tile内读写 清空也放到tile里做
+    if (m_State.deferred) {
+        for (int y = tileMinY; y <= tileMaxY; ++y) {
+            std::fill(&m_Visibility[tileMinX + y * m_Width], &m_Visibility[tileMaxX + y * m_Width] + 1, -1);
+        }
+    }
+
+    int size = bin.size();
+    for (int i = 0; i < size; ++i) {
+        const TriangleSetup& tri = m_Triangles[bin[i]];
+        RasterizeTriangle<ShaderT>(tri, std::max(tri.minX, tileMinX), std::max(tri.minY, tileMinY),
+                          std::min(tri.maxX, tileMaxX), std::min(tri.maxY, tileMaxY));
+    }
+    if (m_State.depthWrite) {
+        m_Depth->UpdateTile(tileX, tileY);
+    }
+
+    if (m_State.deferred) {
+        ResolveTile<ShaderT>(tileMinX, tileMinY, tileMaxX, tileMaxY);
+    }
+}
+
+template<class ShaderT>
+void Rasterizer::ResolveTile(int minX, int minY, int maxX, int maxY) {
+    ShaderT* shader = static_cast<ShaderT*>(m_Shader);
+    int varyingSize = shader->VaryingSize();
+    for (int y = minY; y <= maxY; ++y) {
+        for (int x = minX; x <= maxX; ++x) {
+            int idx = x + y * m_Width;
+            int triIdx = m_Visibility[idx];
+            if (triIdx < 0) {
+                continue;
+            }
+            const TriangleSetup& tri = m_Triangles[triIdx];
+            const void* varyings = varyingSize > 0 ? &m_Varyings[tri.varyingOffset] : nullptr;
+
+            // 重建屏幕空间重心坐标 再做透视矫正
+            vec3 clipBar;
+            if (tri.fixedPoint) {
+                for (int i = 0; i < 3; ++i) {
+                    clipBar[i] = EdgeValue(tri, i, x, y) * tri.invArea * tri.invW[i];
+                }
+            }
+            else {
+                vec3 screenBar = Barycentric(tri.screenPts, vec2(x, y));
+                for (int i = 0; i < 3; ++i) {
+                    clipBar[i] = screenBar[i] / tri.clipPts[i].w;
+                }
+            }
+            clipBar = clipBar / (clipBar.x + clipBar.y + clipBar.z);
+
+            if (m_HDRTarget != nullptr) {
+                vec4 color;
+                if (!shader->FragmentHDR(varyings, clipBar, color)) {
+                    WriteHDR(idx, color);
+                }
+                continue;
+            }
+            QRgb color;
+            if (!shader->Fragment(varyings, clipBar, color) && m_RenderTarget != nullptr) {
+                m_RenderTarget[idx] = color;
+            }
+        }
+    }
+}
+
+template<class ShaderT>
+void Rasterizer::RasterizeTriangle(const TriangleSetup& tri, int minX, int minY, int maxX, int maxY) {
+    if (!tri.fixedPoint) {
+        RasterizeTriangleSlow<ShaderT>(tri, minX, minY, maxX, maxY);
+        return;
+    }
+    if (m_Samples > 1) {
+        RasterizeTriangleMSAA<ShaderT>(tri, minX, minY, maxX, maxY);
+        return;
+    }
+
+    const void* varyings = m_Varyings.empty() ? nullptr : &m_Varyings[tri.varyingOffset];
+
+    // tile是BLOCK_SIZE的整数倍 对齐后的块不会跨tile
+    for (int by = minY & ~(BLOCK_SIZE - 1); by <= maxY; by += BLOCK_SIZE) {
+        for (int bx = minX & ~(BLOCK_SIZE - 1); bx <= maxX; bx += BLOCK_SIZE) {
+            // 块内已有的深度全都比三角形近 整块被挡住
+            int hizX = bx / BLOCK_SIZE, hizY = by / BLOCK_SIZE;
+            if (tri.maxZ < m_Depth->BlockMin(hizX, hizY)) {
+                continue;
+            }
+            // 三角形比块内已有的深度都近 块内像素不用再读zbuffer
+            bool depthPass = m_State.depthTest == DEPTH_LESS_EQUAL && tri.minZ >= m_Depth->BlockMax(hizX, hizY);
+
+            // E是线性的 块内最大值在某个角上取到 只要有一条边的最大值<0 整块都在三角形外
+            int edge[3];
+            bool outside = false;
+            for (int i = 0; i < 3; ++i) {
+                edge[i] = EdgeValue(tri, i, bx, by);
+                int maxEdge = edge[i] + tri.bias[i] + (BLOCK_SIZE - 1) * (std::max(tri.stepX[i], 0) + std::max(tri.stepY[i], 0));
+                if (maxEdge < 0) {
+                    outside = true;
+                    break;
+                }
+            }
+            if (outside) {
+                continue;
+            }
+
+            int x0 = std::max(bx, minX), x1 = std::min(bx + BLOCK_SIZE - 1, maxX);
+            int y0 = std::max(by, minY), y1 = std::min(by + BLOCK_SIZE - 1, maxY);
+            bool written = false;
+            for (int y = y0; y <= y1; ++y) {
+                // 一行8个像素分两组做覆盖和深度测试 再一起交给FragmentBatch
+                float depth[FRAGMENT_BATCH_SIZE];
+                float bar[3][FRAGMENT_BATCH_SIZE] = {};
+                int mask = 0;
+                for (int x = bx; x <= x1; x += 4) {
+                    int laneMask = 0;
+                    for (int k = 0; k < 4; ++k) {
+                        laneMask |= (x + k >= x0 && x + k <= x1) << k;
+                    }
+                    int spanEdge[3];
+                    for (int i = 0; i < 3; ++i) {
+                        spanEdge[i] = edge[i] + (x - bx) * tri.stepX[i] + (y - by) * tri.stepY[i];
+                    }
+                    mask |= CoverSpan(tri, spanEdge, x + y * m_Width, laneMask, depthPass, bar, x - bx, depth + (x - bx)) << (x - bx);
+                }
+                if (mask != 0) {
+                    written |= ShadeBatch<ShaderT>(tri, varyings, bx + y * m_Width, mask, bar, depth);
+                }
+            }
+            if (written) {
+                m_Depth->UpdateBlock(hizX, hizY);
+            }
+        }
+    }
+}
+
+// 与RasterizeTriangle相同的8x8块遍历 覆盖和深度测试逐采样点做 着色仍然一个像素一次
+template<class ShaderT>
+void Rasterizer::RasterizeTriangleMSAA(const TriangleSetup& tri, int minX, int minY, int maxX, int maxY) {
+    const void* varyings = m_Varyings.empty() ? nullptr : &m_Varyings[tri.varyingOffset];
+
+    // 采样点相对像素中心的边方程增量 stepX是一个像素的增量 即16个子像素
+    int sampleEdge[3][MSAA_SAMPLES];
+    int sampleEdgeMax[3];
+    for (int i = 0; i < 3; ++i) {
+        for (int s = 0; s < MSAA_SAMPLES; ++s) {
+            sampleEdge[i][s] = (tri.stepX[i] * SAMPLE_OFFSETS[s][0] + tri.stepY[i] * SAMPLE_OFFSETS[s][1]) / SUBPIXEL_SCALE;
+            sampleEdgeMax[i] = s == 0 ? sampleEdge[i][s] : std::max(sampleEdgeMax[i], sampleEdge[i][s]);
+        }
+    }
+
+    for (int by = minY & ~(BLOCK_SIZE - 1); by <= maxY; by += BLOCK_SIZE) {
+        for (int bx = minX & ~(BLOCK_SIZE - 1); bx <= maxX; bx += BLOCK_SIZE) {
+            int hizX = bx / BLOCK_SIZE, hizY = by / BLOCK_SIZE;
+            if (tri.maxZ < m_Depth->BlockMin(hizX, hizY)) {
+                continue;
+            }
+            bool depthPass = m_State.depthTest == DEPTH_LESS_EQUAL && tri.minZ >= m_Depth->BlockMax(hizX, hizY);
+
+            // 块内边方程的最大值再加上采样点能带来的最大增量
+            int edge[3];
+            bool outside = false;
+            for (int i = 0; i < 3; ++i) {
+                edge[i] = EdgeValue(tri, i, bx, by);
+                int maxEdge = edge[i] + tri.bias[i] + sampleEdgeMax[i] +
+                              (BLOCK_SIZE - 1) * (std::max(tri.stepX[i], 0) + std::max(tri.stepY[i], 0));
+                if (maxEdge < 0) {
+                    outside = true;
+                    break;
+                }
+            }
+            if (outside) {
+                continue;
+            }
+
+            int x0 = std::max(bx, minX), x1 = std::min(bx + BLOCK_SIZE - 1, maxX);
+            int y0 = std::max(by, minY), y1 = std::min(by + BLOCK_SIZE - 1, maxY);
+            bool written = false;
+            for (int y = y0; y <= y1; ++y) {
+                float depth[FRAGMENT_BATCH_SIZE][MSAA_SAMPLES];
+                float bar[3][FRAGMENT_BATCH_SIZE] = {};
+                int sampleMask[FRAGMENT_BATCH_SIZE];
+                int mask = 0;
+                for (int x = x0; x <= x1; ++x) {
+                    int k = x - bx;
+                    int pixelEdge[3];
+                    for (int i = 0; i < 3; ++i) {
+                        pixelEdge[i] = edge[i] + k * tri.stepX[i] + (y - by) * tri.stepY[i];
+                    }
+                    sampleMask[k] = CoverSamples(tri, pixelEdge, sampleEdge, x + y * m_Width, depthPass, depth[k]);
+                    if (sampleMask[k] == 0) {
+                        continue;
+                    }
+                    mask |= 1 << k;
+                    if (m_DepthOnly) {
+                        continue;
+                    }
+                    // 在像素中心插值 中心不在三角形内时是外插 与GPU不加centroid时一样
+                    float sum = 0.f;
+                    for (int i = 0; i < 3; ++i) {
+                        bar[i][k] = pixelEdge[i] * tri.invArea * tri.invW[i];
+                        sum += bar[i][k];
+                    }
+                    for (int i = 0; i < 3; ++i) {
+                        bar[i][k] /= sum;
+                    }
+                }
+                if (mask != 0) {
+                    written |= ShadeBatchMSAA<ShaderT>(varyings, bx + y * m_Width, mask, sampleMask, bar, depth);
+                }
+            }
+            if (written) {
+                m_Depth->UpdateBlock(hizX, hizY);
+            }
+        }
+    }
+}
+
+// 同一行相邻4个像素 edge是最左边像素的边方程值 laneMask标记哪些像素在本次光栅化的区域内
+// depthPass为true时跳过深度测试 返回通过测试的像素mask 重心坐标写到bar[i][lane + k] 深度写到depth[k]
+int Rasterizer::CoverSpan(const TriangleSetup& tri, const int* edge, int idx, int laneMask, bool depthPass,
+                          float (*bar)[FRAGMENT_BATCH_SIZE], int lane, float* depth) {
+#ifdef RASTER_SSE2
+    __m128i cover = _mm_setzero_si128();
+    __m128 lambda[3];
+    for (int i = 0; i < 3; ++i) {
+        __m128i e = _mm_add_epi32(_mm_set1_epi32(edge[i]), _mm_setr_epi32(0, tri.stepX[i], 2 * tri.stepX[i], 3 * tri.stepX[i]));
+        cover = _mm_or_si128(cover, _mm_add_epi32(e, _mm_set1_epi32(tri.bias[i])));
+        lambda[i] = _mm_mul_ps(_mm_cvtepi32_ps(e), _mm_set1_ps(tri.invArea));
+    }
+    // 三个边方程的值或起来后符号位为0 说明都>=0 像素在三角形内
+    int mask = ~_mm_movemask_ps(_mm_castsi128_ps(cover)) & laneMask;
+    if (mask == 0) {
+        return 0;
+    }
+
+    __m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lambda[0], _mm_set1_ps(tri.ndcZ[0])),
+                                     _mm_mul_ps(lambda[1], _mm_set1_ps(tri.ndcZ[1]))),
+                          _mm_mul_ps(lambda[2], _mm_set1_ps(tri.ndcZ[2])));
+    if (!depthPass) {
+        __m128 zbuffer;
+        if (laneMask == 0xf) {
+            zbuffer = _mm_loadu_ps(m_Zbuffer + idx);
+        }
+        else {
+            float tmp[4] = {0, 0, 0, 0};
+            for (int k = 0; k < 4; ++k) {
+                if (laneMask & (1 << k)) {
+                    tmp[k] = m_Zbuffer[idx + k];
+                }
+            }
+            zbuffer = _mm_loadu_ps(tmp);
+        }
+        // 深度测试 z从里到外增大 [far, near]->[0, 1]
+        __m128 pass = m_State.depthTest == DEPTH_EQUAL ? _mm_cmpeq_ps(z, zbuffer) : _mm_cmpnlt_ps(z, zbuffer);
+        mask &= _mm_movemask_ps(pass);
+        if (mask == 0) {
+            return 0;
+        }
+    }
+
+    _mm_storeu_ps(depth, z);
+    if (m_State.deferred || m_DepthOnly) {
+        return mask;
+    }
+
+    // 透视矫正 1/zt = a*1/z1 + b*1/z2 + c*1/z3  It/zt = a*I1/z1 + b*I2/z2 + c*I3/z3
+    __m128 clipBar[3];
+    for (int i = 0; i < 3; ++i) {
+        clipBar[i] = _mm_mul_ps(lambda[i], _mm_set1_ps(tri.invW[i]));
+    }
+    __m128 sum = _mm_add_ps(_mm_add_ps(clipBar[0], clipBar[1]), clipBar[2]);
+    for (int i = 0; i < 3; ++i) {
+        _mm_storeu_ps(bar[i] + lane, _mm_div_ps(clipBar[i], sum));
+    }
+#else
+    int mask = 0;
+    for (int k = 0; k < 4; ++k) {
+        if (!(laneMask & (1 << k))) {
+            continue;
+        }
+        int e[3];
+        for (int i = 0; i < 3; ++i) {
+            e[i] = edge[i] + k * tri.stepX[i];
+        }
+        if ((e[0] + tri.bias[0]) < 0 || (e[1] + tri.bias[1]) < 0 || (e[2] + tri.bias[2]) < 0) {
+            continue;
+        }
+        float lambda[3];
+        for (int i = 0; i < 3; ++i) {
+            lambda[i] = e[i] * tri.invArea;
+        }
+        depth[k] = lambda[0] * tri.ndcZ[0] + lambda[1] * tri.ndcZ[1] + lambda[2] * tri.ndcZ[2];
+        // 深度测试 z从里到外增大 [far, near]->[0, 1]
+        if (!depthPass && !PassDepthTest(depth[k], m_Zbuffer[idx + k])) {
+            continue;
+        }
+        mask |= 1 << k;
+        if (m_State.deferred || m_DepthOnly) {
+            continue;
+        }
+        // 透视矫正 1/zt = a*1/z1 + b*1/z2 + c*1/z3  It/zt = a*I1/z1 + b*I2/z2 + c*I3/z3
+        float sum = 0.f;
+        for (int i = 0; i < 3; ++i) {
+            bar[i][lane + k] = lambda[i] * tri.invW[i];
+            sum += bar[i][lane + k];
+        }
+        for (int i = 0; i < 3; ++i) {
+            bar[i][lane + k] /= sum;
+        }
+    }
+#endif
+    return mask;
+}
+
+// 一个像素的4个采样点 edge是像素中心的边方程值 sampleEdge[i][s]是采样点s相对中心的增量
+// 返回覆盖且通过深度测试的采样点mask 各采样点的深度写到depth[s]
+int Rasterizer::CoverSamples(const TriangleSetup& tri, const int* edge, const int (*sampleEdge)[MSAA_SAMPLES], int idx, bool depthPass, float* depth) {
+    const float* zbuffer = m_Zbuffer + idx * MSAA_SAMPLES;
+#ifdef RASTER_SSE2
+    __m128i cover = _mm_setzero_si128();
+    __m128 lambda[3];
+    for (int i = 0; i < 3; ++i) {
+        __m128i e = _mm_add_epi32(_mm_set1_epi32(edge[i]), _mm_loadu_si128((const __m128i*)sampleEdge[i]));
+        cover = _mm_or_si128(cover, _mm_add_epi32(e, _mm_set1_epi32(tri.bias[i])));
+        lambda[i] = _mm_mul_ps(_mm_cvtepi32_ps(e), _mm_set1_ps(tri.invArea));
+    }
+    int mask = ~_mm_movemask_ps(_mm_castsi128_ps(cover)) & 0xf;
+    if (mask == 0) {
+        return 0;
+    }
+
+    __m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lambda[0], _mm_set1_ps(tri.ndcZ[0])),
+                                     _mm_mul_ps(lambda[1], _mm_set1_ps(tri.ndcZ[1]))),
+                          _mm_mul_ps(lambda[2], _mm_set1_ps(tri.ndcZ[2])));
+    if (!depthPass) {
+        // 同一像素的采样点连续存放 一次读进来
+        __m128 zb = _mm_loadu_ps(zbuffer);
+        __m128 pass = m_State.depthTest == DEPTH_EQUAL ? _mm_cmpeq_ps(z, zb) : _mm_cmpnlt_ps(z, zb);
+        mask &= _mm_movemask_ps(pass);
+    }
+    _mm_storeu_ps(depth, z);
+#else
+    int mask = 0;
+    for (int s = 0; s < MSAA_SAMPLES; ++s) {
+        int e[3];
+        for (int i = 0; i < 3; ++i) {
+            e[i] = edge[i] + sampleEdge[i][s];
+        }
+        if ((e[0] + tri.bias[0]) < 0 || (e[1] + tri.bias[1]) < 0 || (e[2] + tri.bias[2]) < 0) {
+            continue;
+        }
+        depth[s] = e[0] * tri.invArea * tri.ndcZ[0] + e[1] * tri.invArea * tri.ndcZ[1] + e[2] * tri.invArea * tri.ndcZ[2];
+        if (!depthPass && !PassDepthTest(depth[s], zbuffer[s])) {
+            continue;
+        }
+        mask |= 1 << s;
+    }
+#endif
+    return mask;
+}
+
+// 一行最多8个通过测试的像素 交给FragmentBatch着色 返回是否写入了深度(关掉深度写入时总是false)
+template<class ShaderT>
+bool Rasterizer::ShadeBatch(const TriangleSetup& tri, const void* varyings, int idx, int mask,
+                            const float (*bar)[FRAGMENT_BATCH_SIZE], const float* depth) {
+    if (m_State.deferred) {
+        return WriteVisibility(tri, idx, depth, mask);
+    }
+    if (m_DepthOnly) {
+        return WriteDepth(idx, depth, mask);
+    }
+
+    if (m_HDRTarget != nullptr) {
+        vec4 colors[FRAGMENT_BATCH_SIZE];
+        mask &= ~static_cast<ShaderT*>(m_Shader)->FragmentBatchHDR(varyings, bar, mask, colors);
+        for (int k = 0; k < FRAGMENT_BATCH_SIZE; ++k) {
+            if (mask & (1 << k)) {
+                WriteHDR(idx + k, colors[k]);
+                if (m_State.depthWrite) {
+                    m_Zbuffer[idx + k] = depth[k];
+                }
+            }
+        }
+        return mask != 0 && m_State.depthWrite;
+    }
+
+    QRgb colors[FRAGMENT_BATCH_SIZE];
+    mask &= ~static_cast<ShaderT*>(m_Shader)->FragmentBatch(varyings, bar, mask, colors);
+    for (int k = 0; k < FRAGMENT_BATCH_SIZE; ++k) {
+        if (mask & (1 << k)) {
+            if (m_RenderTarget != nullptr) {
+                m_RenderTarget[idx + k] = colors[k];
+            }
+            if (m_State.depthWrite) {
+                m_Zbuffer[idx + k] = depth[k];
+            }
+        }
+    }
+    return mask != 0 && m_State.depthWrite;
+}
+
+// 多重采样 一行最多8个像素各着色一次 颜色和深度写到该像素通过测试的采样点
+template<class ShaderT>
+bool Rasterizer::ShadeBatchMSAA(const void* varyings, int idx, int mask, const int* sampleMask,
+                                const float (*bar)[FRAGMENT_BATCH_SIZE], const float (*depth)[MSAA_SAMPLES]) {
+    ShaderT* shader = static_cast<ShaderT*>(m_Shader);
+    vec4 hdrColors[FRAGMENT_BATCH_SIZE];
+    QRgb colors[FRAGMENT_BATCH_SIZE];
+    if (m_HDRTarget != nullptr) {
+        mask &= ~shader->FragmentBatchHDR(varyings, bar, mask, hdrColors);
+    }
+    else if (!m_DepthOnly) {
+        mask &= ~shader->FragmentBatch(varyings, bar, mask, colors);
+    }
+
+    for (int k = 0; k < FRAGMENT_BATCH_SIZE; ++k) {
+        if (!(mask & (1 << k))) {
+            continue;
+        }
+        for (int s = 0; s < MSAA_SAMPLES; ++s) {
+            if (!(sampleMask[k] & (1 << s))) {
+                continue;
+            }
+            int sampleIdx = (idx + k) * MSAA_SAMPLES + s;
+            if (m_HDRTarget != nullptr) {
+                WriteHDR(sampleIdx, hdrColors[k]);
+            }
+            else if (m_RenderTarget != nullptr) {
+                m_RenderTarget[sampleIdx] = colors[k];
+            }
+            if (m_State.depthWrite) {
+                m_Zbuffer[sampleIdx] = depth[k][s];
+            }
+        }
+    }
+    return mask != 0 && m_State.depthWrite;
+}
+
+// deferred模式只写深度和三角形序号 着色留到ResolveTile
+bool Rasterizer::WriteVisibility(const TriangleSetup& tri, int idx, const float* depth, int mask) {
+    int triIdx = &tri - m_Triangles.data();
+    for (int k = 0; k < FRAGMENT_BATCH_SIZE; ++k) {
+        if (mask & (1 << k)) {
+            m_Visibility[idx + k] = triIdx;
+            if (m_State.depthWrite) {
+                m_Zbuffer[idx + k] = depth[k];
+            }
+        }
+    }
+    return mask != 0 && m_State.depthWrite;
+}
+
+// depth only模式 通过测试的像素直接写深度
+bool Rasterizer::WriteDepth(int idx, const float* depth, int mask) {
+    if (!m_State.depthWrite) {
+        return false;
+    }
+    for (int k = 0; k < FRAGMENT_BATCH_SIZE; ++k) {
+        if (mask & (1 << k)) {
+            m_Zbuffer[idx + k] = depth[k];
+        }
+    }
+    return mask != 0;
+}
+
+// 顶点在相机后面或三角形过大时 逐像素求浮点重心坐标 多重采样时逐采样点测试 在像素中心着色
+template<class ShaderT>
+void Rasterizer::RasterizeTriangleSlow(const TriangleSetup& tri, int minX, int minY, int maxX, int maxY) {
+    ShaderT* shader = static_cast<ShaderT*>(m_Shader);
+    const vec4* clipPts = tri.clipPts;
+    const void* varyings = m_Varyings.empty() ? nullptr : &m_Varyings[tri.varyingOffset];
+
+    for (int y = minY; y <= maxY; ++y) {
+        for (int x = minX; x <= maxX; ++x) {
+            int idx = x + y * m_Width;
+            vec3 clipBar;
+            float depth[MSAA_SAMPLES];
+            int mask = 0;
+            for (int s = 0; s < m_Samples; ++s) {
+                vec2 p(x, y);
+                if (m_Samples > 1) {
+                    p = p + vec2(SAMPLE_OFFSETS[s][0], SAMPLE_OFFSETS[s][1]) / (float)SUBPIXEL_SCALE;
+                }
+                vec3 screenBar = Barycentric(tri.screenPts, p);    // 屏幕空间重心坐标
+                if (screenBar.x < 0.f || screenBar.y < 0.f || screenBar.z < 0.f) {
+                    continue;
+                }
+                // 计算实际空间的重心坐标 透视矫正 1/zt = a*1/z1 + b*1/z2 + c*1/z3  It/zt = a*I1/z1 + b*I2/z2 + c*I3/z3 然后view->proj后w分量是z值
+                clipBar = vec3(screenBar.x / clipPts[0].w, screenBar.y / clipPts[1].w, screenBar.z / clipPts[2].w);
+                clipBar = clipBar / (clipBar.x + clipBar.y + clipBar.z);
+                depth[s] = (clipBar.x * clipPts[0].z + clipBar.y * clipPts[1].z + clipBar.z * clipPts[2].z) / (clipBar.x * clipPts[0].w + clipBar.y * clipPts[1].w + clipBar.z * clipPts[2].w);
+                // 深度测试 z从里到外增大 [far, near]->[0, 1]
+                if (PassDepthTest(depth[s], m_Zbuffer[idx * m_Samples + s])) {
+                    mask |= 1 << s;
+                }
+            }
+            if (mask == 0) {
+                continue;
+            }
+            if (m_State.deferred) {
+                WriteVisibility(tri, idx, depth, 1);
+                continue;
+            }
+            if (!m_DepthOnly) {
+                if (m_Samples > 1) {
+                    vec3 screenBar = Barycentric(tri.screenPts, vec2(x, y));
+                    clipBar = vec3(screenBar.x / clipPts[0].w, screenBar.y / clipPts[1].w, screenBar.z / clipPts[2].w);
+                    clipBar = clipBar / (clipBar.x + clipBar.y + clipBar.z);
+                }
+                QRgb color = 0;
+                vec4 hdrColor;
+                bool discard = m_HDRTarget != nullptr ? shader->FragmentHDR(varyings, clipBar, hdrColor) : shader->Fragment(varyings, clipBar, color);
+                if (discard) {
+                    continue;
+                }
+                for (int s = 0; s < m_Samples; ++s) {
+                    if (!(mask & (1 << s))) {
+                        continue;
+                    }
+                    if (m_HDRTarget != nullptr) {
+                        WriteHDR(idx * m_Samples + s, hdrColor);
+                    }
+                    else if (m_RenderTarget != nullptr) {
+                        m_RenderTarget[idx * m_Samples + s] = color;
+                    }
+                }
+            }
+            if (m_State.depthWrite) {
+                for (int s = 0; s < m_Samples; ++s) {
+                    if (mask & (1 << s)) {
+                        m_Zbuffer[idx * m_Samples + s] = depth[s];
+                    }
+                }
+            }
+        }
+    }
+
+    if (!m_State.depthWrite) {
+        return;
+    }
+    for (int by = minY / BLOCK_SIZE; by <= maxY / BLOCK_SIZE; ++by) {
+        for (int bx = minX / BLOCK_SIZE; bx <= maxX / BLOCK_SIZE; ++bx) {
+            m_Depth->UpdateBlock(bx, by);
+        }
+    }
+}
+
+// 解重心坐标 u*AB + v*AC + PA = 0
+vec3 Rasterizer::Barycentric(const vec2* pts, vec2 p) {
+    vec3 ret = cross(
+        vec3(pts[1].x - pts[0].x, pts[2].x - pts[0].x, pts[0].x - p.x),
+        vec3(pts[1].y - pts[0].y, pts[2].y - pts[0].y, pts[0].y - p.y)
+    );
+
+    // 整数坐标输入 cross后应该也是整数 abs(ret.z)<1意味着ret[2]是0 即输入三角形退化成线段或点
+    if (std::abs(ret.z) < 1.f) {
+        return vec3(-1.f, 1.f, 1.f);
+    }
+    // (ret.x + ret.y) / ret.z 先+后x 增加精度 避免在BC边上像素漏画
+    return vec3(1.f - (ret.x + ret.y) / ret.z, ret.x / ret.z, ret.y / ret.z);
+}
+
+// 每种shader一份tile光栅化 IShader是走虚函数的通用版本
+template void Rasterizer::RasterizeTile<IShader>(int);
+template void Rasterizer::RasterizeTile<GeneralShader>(int);
+template void Rasterizer::RasterizeTile<ShadowMapShader>(int);
+template void Rasterizer::RasterizeTile<ZWriteShader>(int);
+template void Rasterizer::RasterizeTile<RayTracerShader>(int);
+template void Rasterizer::RasterizeTile<PathTracerShader>(int);
@@ -0,0 +1,199 @@
+#ifndef RASTERIZER_H
+#define RASTERIZER_H
+
+#include <vector>
+#include <QRgb>
+#include "geometry.h"
+#include "shader.h"
+#include "depthbuffer.h"
+#include "colorbuffer.h"
+
+/* sort-middle光栅化器
+ * 1. 分箱阶段: 顶点着色后的三角形按屏幕包围盒分配到固定大小的tile中 同时保存该三角形的varying
+ * 2. 光栅化阶段: 每个线程负责整块tile 按提交顺序光栅化该tile箱中的三角形
+ * 一个tile只会被一个线程写入 所以zbuffer和render target不需要加锁
+ *
+ * 三角形setup时算好定点数的边方程 光栅化以8x8像素块为单位 整块都在某条边外侧的直接跳过
+ * 块内每行4个像素一组用SSE2同时做覆盖测试 深度测试和重心坐标计算 一行8个像素一起交给FragmentBatch着色
+ *
+ * 深度缓冲自带Hi-Z 分箱时三角形最大深度小于tile最小深度的tile不进箱 光栅化时同理跳过被挡住的8x8块
+ *
+ * 提交的三角形先在齐次空间裁剪: 完全在视锥某个面外侧的直接丢掉 与近平面相交的裁掉相机后面的部分
+ * x/y方向只对超出guard band的大三角形裁剪 guard band以内的部分交给光栅化时的包围盒去限制
+ * 裁剪前先按每次draw的cullMode剔除正面/背面 setup时再丢掉面积为0或者没有盖住任何像素中心的三角形
+ *
+ * deferred模式(visibility buffer): 光栅化时只写深度和三角形序号 不调用Fragment
+ * 每个tile光栅化完后再逐像素由三角形序号重建重心坐标 每个像素只着色一次 与overdraw和三角形顺序无关
+ * 这种模式下Fragment返回discard时像素保持原样 不会露出后面的三角形 有discard的shader需要用forward模式
+ *
+ * 多重采样: 深度缓冲有4个采样点时每个像素按旋转网格的4个位置分别做覆盖和深度测试(一个像素的4个采样点正好是一个SSE寄存器)
+ * 只要有采样点通过 就在像素中心插值varying调用一次FragmentBatch 颜色写到通过测试的采样点 着色开销和单采样相当
+ * render target的采样数必须和深度相同 多重采样时不支持deferred模式 自动退回forward
+ *
+ * 深度已经由prepass写好时可以用DEPTH_EQUAL并关掉深度写入 只有最终可见的像素会调用Fragment
+ * 前提是两个pass的顶点着色器算出完全一样的clip坐标(见ObjectToClipPos)
+ *
+ * tile光栅化的整条路径按shader类型实例化 Begin传入具体的(final)shader时Fragment/FragmentBatch直接调用 可以内联
+ * 传入IShader*时走虚函数 插件等在这里没有实例化的shader也能用 新增内置shader需要在rasterizer.cpp末尾加一行实例化
+ */
+class Rasterizer {
+public:
+    static const int TILE_SIZE = DepthBuffer::TILE_SIZE;      // px 与Hi-Z的tile一致
+    static const int BLOCK_SIZE = DepthBuffer::BLOCK_SIZE;    // px 与Hi-Z的块一致
+    static const int SUBPIXEL_BITS = 4;         // 顶点坐标吸附到1/16像素
+    static const int SUBPIXEL_SCALE = 1 << SUBPIXEL_BITS;
+    static const int FIXED_MAX_EXTENT = 1536;   // px 包围盒超过这个范围时边方程会溢出int32 guard band据此确定
+    static const int MAX_CLIP_VERTS = 9;        // 三角形被5个面裁剪后最多8个顶点
+    static const int MSAA_SAMPLES = 4;          // 多重采样的采样点数 深度缓冲的采样数只能是1或者它
+
+    enum CullMode {
+        CULL_NONE = 0,
+        CULL_BACK,          // 剔除背面 顶点在屏幕上顺时针为正面
+        CULL_FRONT          // 剔除正面
+    };
+
+    // 深度越近值越大 [far, near]->[0, 1] 这里的LESS/EQUAL按离相机的距离来说
+    enum DepthTest {
+        DEPTH_LESS_EQUAL = 0,   // 不比zbuffer远就通过
+        DEPTH_EQUAL             // 与zbuffer相等才通过 配合深度prepass使用 只着色最终可见的像素
+    };
+
+    // 每次draw的渲染状态
+    struct RenderState {
+        CullMode cullMode;
+        DepthTest depthTest;
+        bool depthWrite;
+        bool deferred;              // visibility buffer 每个像素只着色一次
+
+        RenderState() : cullMode(CULL_BACK), depthTest(DEPTH_LESS_EQUAL), depthWrite(true), deferred(false) {}
+    };
+
+    // 被剔除的三角形数 Begin不会清零 需要时调用ResetStats
+    struct Stats {
+        int submitted = 0;          // 提交的三角形
+        int frustumCulled = 0;      // 完全在视锥外
+        int backfaceCulled = 0;     // 按CullMode剔除的正面/背面
+        int degenerateCulled = 0;   // 面积为0 或者没有盖住任何像素中心(多重采样时为采样点)
+        int occludedCulled = 0;     // 被Hi-Z挡住 一个tile都没进
+
+        Stats& operator+=(const Stats& other) {
+            submitted += other.submitted;
+            frustumCulled += other.frustumCulled;
+            backfaceCulled += other.backfaceCulled;
+            degenerateCulled += other.degenerateCulled;
+            occludedCulled += other.occludedCulled;
+            return *this;
+        }
+    };
+
+private:
+    struct TriangleSetup {
+        vec4 clipPts[3];
+        vec2 screenPts[3];
+        int minX, minY, maxX, maxY;         // 屏幕包围盒 已限制在render target内
+        int varyingOffset;                  // 该三角形的varying在m_Varyings中的起始字节
+
+        // 边方程 E_i(P) = a_i * P.x + b_i * P.y + c_i (P以子像素为单位) 第i条边是顶点i对面的边
+        // 三角形内部E_i >= 0 且 E_i / area 就是顶点i的屏幕空间重心坐标
+        bool fixedPoint;                    // false: render target比guard band还大导致三角形太大 退回逐像素浮点重心坐标
+        long long edgeC[3];
+        int stepX[3], stepY[3];             // 像素坐标+1时E_i的增量 即a_i * SUBPIXEL_SCALE
+        int bias[3];                        // 填充规则 两个三角形的公共边只归属其中一个
+        float invArea;
+        float invW[3];                      // 1/w 用于透视矫正
+        float ndcZ[3];                      // z/w 屏幕空间线性插值即为深度
+        float minZ, maxZ;                   // 三角形深度范围 用于Hi-Z剔除
+    };
+
+    int m_Width, m_Height;                  // render target分辨率
+    int m_TileCountX, m_TileCountY;
+    float m_GuardBandX, m_GuardBandY;       // guard band在ndc中的范围 |x/w| <= m_GuardBandX
+
+    IShader* m_Shader = nullptr;
+    typedef void (Rasterizer::*RasterizeTileFunc)(int);
+    RasterizeTileFunc m_RasterizeTile = nullptr;    // 按当前shader类型实例化的RasterizeTile
+    ColorBuffer* m_Color = nullptr;
+    QRgb* m_RenderTarget = nullptr;         // m_Color->Data() 只写深度或浮点格式时为nullptr
+    float* m_HDRTarget = nullptr;           // m_Color->HDRData() 浮点格式时走FragmentHDR
+    DepthBuffer* m_Depth = nullptr;
+    float* m_Zbuffer = nullptr;             // m_Depth->Data()
+    int m_Samples = 1;                      // m_Depth->Samples()
+    RenderState m_State;
+    bool m_DepthOnly = false;               // 没有render target且shader声明DepthOnly 不调用片元着色
+    std::vector<int> m_Visibility;          // deferred模式下每个像素可见的三角形序号 -1为空
+    Stats m_Stats;
+
+    std::vector<TriangleSetup> m_Triangles;     // 本次draw提交的三角形
+    std::vector<char> m_Varyings;               // 每个三角形三个顶点的v2f 连续存放
+    std::vector<std::vector<int> > m_Bins;      // 每个tile覆盖到的三角形序号 按提交顺序
+    std::vector<float> m_ClipVaryings;          // 裁剪时产生的新顶点的varying
+
+    enum ClipPlane {
+        CLIP_NEAR = 0,
+        CLIP_GUARD_LEFT,
+        CLIP_GUARD_RIGHT,
+        CLIP_GUARD_TOP,
+        CLIP_GUARD_BOTTOM,
+        CLIP_PLANE_COUNT
+    };
+
+    bool IsFaceCulled(const vec4* clipPts) const;             // 按m_State.cullMode判断正反面
+    float PlaneDistance(const vec4& p, int plane) const;   // >=0 在裁剪面内侧
+    void ClipTriangle(const vec4* clipPts, const void* const* varyings, int planeMask);
+    void SetupTriangle(const vec4* clipPts, const void* const* varyings);
+    bool SetupEdges(TriangleSetup& tri);
+    void BeginDraw(IShader* shader, ColorBuffer* renderTarget, DepthBuffer* depth, const RenderState& state);
+    template<class ShaderT> void RasterizeTile(int tileIdx);
+    template<class ShaderT> void RasterizeTriangle(const TriangleSetup& tri, int minX, int minY, int maxX, int maxY);
+    template<class ShaderT> void RasterizeTriangleSlow(const TriangleSetup& tri, int minX, int minY, int maxX, int maxY);
+    template<class ShaderT> void ResolveTile(int minX, int minY, int maxX, int maxY);   // deferred模式 着色tile内可见的像素
+    template<class ShaderT> void RasterizeTriangleMSAA(const TriangleSetup& tri, int minX, int minY, int maxX, int maxY);
+    int CoverSpan(const TriangleSetup& tri, const int* edge, int idx, int laneMask, bool depthPass,
+                  float (*bar)[FRAGMENT_BATCH_SIZE], int lane, float* depth);
+    int CoverSamples(const TriangleSetup& tri, const int* edge, const int (*sampleEdge)[MSAA_SAMPLES], int idx, bool depthPass, float* depth);
+    template<class ShaderT> bool ShadeBatch(const TriangleSetup& tri, const void* varyings, int idx, int mask,
+                                            const float (*bar)[FRAGMENT_BATCH_SIZE], const float* depth);
+    template<class ShaderT> bool ShadeBatchMSAA(const void* varyings, int idx, int mask, const int* sampleMask,
+                                                const float (*bar)[FRAGMENT_BATCH_SIZE], const float (*depth)[MSAA_SAMPLES]);
+    bool WriteVisibility(const TriangleSetup& tri, int idx, const float* depth, int mask);
+    bool WriteDepth(int idx, const float* depth, int mask);
+    static vec3 Barycentric(const vec2* pts, vec2 p);      // pts[0]=A pts[1]=B pts[2]=C p=P
+
+    inline void WriteHDR(int idx, const vec4& color) {     // 多重采样时idx是采样点序号
+        float* p = m_HDRTarget + 4 * idx;
+        p[0] = color.x;
+        p[1] = color.y;
+        p[2] = color.z;
+        p[3] = color.w;
+    }
+
+    inline bool PassDepthTest(float depth, float zbuffer) const {
+        return m_State.depthTest == DEPTH_EQUAL ? depth == zbuffer : depth >= zbuffer;
+    }
+
+    inline int EdgeValue(const TriangleSetup& tri, int i, int x, int y) const {
+        return (int)(tri.edgeC[i] + (long long)tri.stepX[i] * x + (long long)tri.stepY[i] * y);
+    }
+
+public:
+    Rasterizer(int width, int height);
+
+    // 开始一次draw 逐片元走虚函数 renderTarget为nullptr时只写深度
+    // shader声明了DepthOnly时不再调用片元着色 否则shader仍会被调用 用于discard
+    void Begin(IShader* shader, ColorBuffer* renderTarget, DepthBuffer* depth, const RenderState& state = RenderState());
+
+    // 同上 按具体shader类型光栅化 ShaderT必须在rasterizer.cpp中实例化过
+    template<class ShaderT>
+    void Begin(ShaderT* shader, ColorBuffer* renderTarget, DepthBuffer* depth, const RenderState& state = RenderState()) {
+        BeginDraw(shader, renderTarget, depth, state);
+        m_RasterizeTile = &Rasterizer::RasterizeTile<ShaderT>;
+    }
+    bool Cull(const vec4* clipPts);         // 视锥和正反面剔除 返回true表示三角形被丢掉 可以在顶点着色前调用
+    void Submit(const vec4* clipPts, const void* const* varyings);     // 提交已经过Cull的三角形 varyings是三个顶点各自的v2f
+    void Flush();                           // 分tile并行光栅化所有提交的三角形
+
+    const Stats& GetStats() const { return m_Stats; }
+    void ResetStats() { m_Stats = Stats(); }
+};
+
+#endif // RASTERIZER_H
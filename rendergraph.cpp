@@ -0,0 +1,271 @@
+#include "rendergraph.h"
+#include <algorithm>
+#include <thread>
+
+RenderGraph::Handle RenderGraph::PassBuilder::Read(Handle h) {
+    m_Graph->m_Passes[m_Pass].reads.push_back(h);
+    return h;
+}
+
+RenderGraph::Handle RenderGraph::PassBuilder::Write(Handle h) {
+    m_Graph->m_Passes[m_Pass].writes.push_back(h);
+    return h;
+}
+
+RenderGraph::RenderGraph(int width, int height, float depthClearValue) :
+    m_Width(width), m_Height(height), m_DepthClearValue(depthClearValue)
+{}
+
+RenderGraph::~RenderGraph() {
+    ReleasePhysical();
+}
+
+RenderGraph::Handle RenderGraph::AddResource(const char* name, ResourceType type, ColorBuffer* externalColor, DepthBuffer* externalDepth) {
+    Resource res;
+    res.name = name;
+    res.type = type;
+    res.format = ColorBuffer::FORMAT_RGBA8;
+    res.samples = 1;
+    res.externalColor = externalColor;
+    res.externalDepth = externalDepth;
+    m_Resources.push_back(res);
+    m_Compiled = false;
+    return m_Resources.size() - 1;
+}
+
+RenderGraph::Handle RenderGraph::ImportColor(const char* name, ColorBuffer* buffer) {
+    return AddResource(name, RESOURCE_COLOR, buffer, nullptr);
+}
+
+RenderGraph::Handle RenderGraph::ImportDepth(const char* name, DepthBuffer* buffer) {
+    return AddResource(name, RESOURCE_DEPTH, nullptr, buffer);
+}
+
+RenderGraph::Handle RenderGraph::CreateColor(const char* name, ColorBuffer::Format format, int samples) {
+    Handle h = AddResource(name, RESOURCE_COLOR, nullptr, nullptr);
+    m_Resources[h].format = format;
+    m_Resources[h].samples = samples;
+    return h;
+}
+
+RenderGraph::Handle RenderGraph::CreateDepth(const char* name, int samples) {
+    Handle h = AddResource(name, RESOURCE_DEPTH, nullptr, nullptr);
+    m_Resources[h].samples = samples;
+    return h;
+}
+
+void RenderGraph::AddPass(const char* name, const SetupFunc& setup, const ExecuteFunc& execute) {
+    Pass pass;
+    pass.name = name;
+    pass.execute = execute;
+    m_Passes.push_back(pass);
+    PassBuilder builder(this, m_Passes.size() - 1);
+    setup(builder);
+    m_Compiled = false;
+}
+
+void RenderGraph::ReleasePhysical() {
+    for (size_t i = 0; i < m_Physical.size(); ++i) {
+        delete m_Physical[i].color;
+        delete m_Physical[i].depth;
+    }
+    m_Physical.clear();
+}
+
+void RenderGraph::Compile() {
+    ReleasePhysical();
+
+    // 分波: pass排在它依赖的所有pass的下一波
+    int resCount = m_Resources.size();
+    std::vector<int> lastWriter(resCount, -1);
+    std::vector<std::vector<int> > readers(resCount);     // 上一次写入之后读过的pass
+    int waveCount = 0;
+    for (size_t i = 0; i < m_Passes.size(); ++i) {
+        Pass& pass = m_Passes[i];
+        int wave = 0;
+        for (size_t j = 0; j < pass.reads.size(); ++j) {
+            int writer = lastWriter[pass.reads[j]];
+            if (writer >= 0) {
+                wave = std::max(wave, m_Passes[writer].wave + 1);
+            }
+        }
+        for (size_t j = 0; j < pass.writes.size(); ++j) {
+            Handle h = pass.writes[j];
+            if (lastWriter[h] >= 0) {
+                wave = std::max(wave, m_Passes[lastWriter[h]].wave + 1);
+            }
+            for (size_t k = 0; k < readers[h].size(); ++k) {
+                wave = std::max(wave, m_Passes[readers[h][k]].wave + 1);
+            }
+        }
+        pass.wave = wave;
+        waveCount = std::max(waveCount, wave + 1);
+
+        for (size_t j = 0; j < pass.reads.size(); ++j) {
+            readers[pass.reads[j]].push_back(i);
+        }
+        for (size_t j = 0; j < pass.writes.size(); ++j) {
+            lastWriter[pass.writes[j]] = i;
+            readers[pass.writes[j]].clear();
+        }
+    }
+
+    m_Waves.assign(waveCount, std::vector<int>());
+    m_ClearBeforeWave.assign(waveCount, std::vector<Handle>());
+    m_ResolveBeforeWave.assign(waveCount, std::vector<Handle>());
+    for (int h = 0; h < resCount; ++h) {
+        m_Resources[h].firstWave = m_Resources[h].lastWave = -1;
+        m_Resources[h].physical = -1;
+    }
+    for (size_t i = 0; i < m_Passes.size(); ++i) {
+        const Pass& pass = m_Passes[i];
+        m_Waves[pass.wave].push_back(i);
+        for (size_t j = 0; j < pass.reads.size(); ++j) {
+            std::vector<Handle>& resolves = m_ResolveBeforeWave[pass.wave];
+            if (std::find(resolves.begin(), resolves.end(), pass.reads[j]) == resolves.end()) {
+                resolves.push_back(pass.reads[j]);
+            }
+        }
+        for (int rw = 0; rw < 2; ++rw) {
+            const std::vector<Handle>& handles = rw ? pass.writes : pass.reads;
+            for (size_t j = 0; j < handles.size(); ++j) {
+                Resource& res = m_Resources[handles[j]];
+                res.firstWave = res.firstWave < 0 ? pass.wave : std::min(res.firstWave, pass.wave);
+                res.lastWave = std::max(res.lastWave, pass.wave);
+            }
+        }
+    }
+
+    // 按第一次用到的先后分配内存 已经用完的同类型buffer直接复用
+    std::vector<Handle> order;
+    for (int h = 0; h < resCount; ++h) {
+        const Resource& res = m_Resources[h];
+        if (res.externalColor == nullptr && res.externalDepth == nullptr && res.firstWave >= 0) {
+            order.push_back(h);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [this](Handle a, Handle b) {
+        return m_Resources[a].firstWave < m_Resources[b].firstWave;
+    });
+    for (size_t i = 0; i < order.size(); ++i) {
+        Resource& res = m_Resources[order[i]];
+        int physical = -1;
+        for (size_t j = 0; j < m_Physical.size(); ++j) {
+            const PhysicalBuffer& buffer = m_Physical[j];
+            if (buffer.type == res.type && buffer.format == res.format && buffer.samples == res.samples && buffer.lastWave < res.firstWave) {
+                physical = j;
+                break;
+            }
+        }
+        if (physical < 0) {
+            PhysicalBuffer buffer;
+            buffer.type = res.type;
+            buffer.format = res.format;
+            buffer.samples = res.samples;
+            if (res.type == RESOURCE_COLOR) {
+                buffer.color = new ColorBuffer(m_Width, m_Height, res.format, res.samples);
+            }
+            else {
+                buffer.depth = new DepthBuffer(m_Width, m_Height, res.samples);
+            }
+            m_Physical.push_back(buffer);
+            physical = m_Physical.size() - 1;
+        }
+        m_Physical[physical].lastWave = res.lastWave;
+        res.physical = physical;
+        m_ClearBeforeWave[res.firstWave].push_back(order[i]);
+    }
+    m_Compiled = true;
+}
+
+void RenderGraph::ClearResource(Handle h) {
+    const Resource& res = m_Resources[h];
+    if (res.type == RESOURCE_DEPTH) {
+        m_Physical[res.physical].depth->Clear(m_DepthClearValue);
+    }
+    else {
+        m_Physical[res.physical].color->Clear(255 << 24);
+    }
+}
+
+void RenderGraph::ResolveResource(Handle h) {
+    if (m_Resources[h].type == RESOURCE_DEPTH) {
+        Depth(h)->Resolve();
+    }
+    else {
+        Color(h)->Resolve();
+    }
+}
+
+void RenderGraph::RunWave(int wave) {
+    const std::vector<int>& passes = m_Waves[wave];
+    if (!m_Parallel || passes.size() == 1) {
+        for (size_t i = 0; i < passes.size(); ++i) {
+            m_Passes[passes[i]].execute(0);
+        }
+        return;
+    }
+
+    // 每个线程里的pass各自开OpenMP线程组
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < passes.size(); ++i) {
+        const ExecuteFunc& execute = m_Passes[passes[i]].execute;
+        int worker = i;
+        threads.push_back(std::thread([&execute, worker]() { execute(worker); }));
+    }
+    m_Passes[passes[0]].execute(0);
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+}
+
+void RenderGraph::Execute() {
+    if (!m_Compiled) {
+        Compile();
+    }
+    int waveCount = m_Waves.size();
+    for (int w = 0; w < waveCount; ++w) {
+        const std::vector<Handle>& clears = m_ClearBeforeWave[w];
+        for (size_t i = 0; i < clears.size(); ++i) {
+            ClearResource(clears[i]);
+        }
+        const std::vector<Handle>& resolves = m_ResolveBeforeWave[w];
+        for (size_t i = 0; i < resolves.size(); ++i) {
+            ResolveResource(resolves[i]);
+        }
+        RunWave(w);
+    }
+}
+
+ColorBuffer* RenderGraph::Color(Handle h) const {
+    const Resource& res = m_Resources[h];
+    if (res.externalColor != nullptr) {
+        return res.externalColor;
+    }
+    return res.physical >= 0 ? m_Physical[res.physical].color : nullptr;
+}
+
+DepthBuffer* RenderGraph::Depth(Handle h) const {
+    const Resource& res = m_Resources[h];
+    if (res.externalDepth != nullptr) {
+        return res.externalDepth;
+    }
+    return res.physical >= 0 ? m_Physical[res.physical].depth : nullptr;
+}
+
+int RenderGraph::WorkerCount() const {
+    size_t count = 1;
+    for (size_t i = 0; i < m_Waves.size(); ++i) {
+        count = std::max(count, m_Waves[i].size());
+    }
+    return m_Parallel ? count : 1;
+}
+
+size_t RenderGraph::TransientBytes() const {
+    size_t bytes = 0;
+    for (size_t i = 0; i < m_Physical.size(); ++i) {
+        const PhysicalBuffer& buffer = m_Physical[i];
+        bytes += (size_t)m_Width * m_Height * (buffer.type == RESOURCE_COLOR ? buffer.color->BytesPerPixel() : buffer.samples * sizeof(float));
+    }
+    return bytes;
+}
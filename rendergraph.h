@@ -0,0 +1,111 @@
+#ifndef RENDERGRAPH_H
+#define RENDERGRAPH_H
+
+#include <vector>
+#include <string>
+#include <functional>
+#include "depthbuffer.h"
+#include "colorbuffer.h"
+
+/* 一帧的pass依赖图
+ * 1. 声明阶段: 每个pass声明自己读写的buffer 按AddPass的顺序就是串行执行时的顺序
+ * 2. Compile: 由读写关系得到依赖(写后读 写后写 读后写) 按最长依赖链分成若干波 同一波的pass互不依赖
+ *    transient buffer的生存期是[第一次用到的波, 最后一次用到的波] 生存期不重叠的同类型同格式同采样数buffer共用一块内存
+ * 3. Execute: 逐波执行 同一波的pass各开一个线程并行 每个pass内部仍然用OpenMP分tile并行
+ *    transient buffer在第一次用到的那一波开始前清空(颜色清成黑色 深度清成最远) 清空只设置tile标记
+ *    pass声明Read的buffer要当贴图采样 在这一波开始前Resolve 把没写过的tile填成清空值
+ *
+ * 每一波的第一个pass在调用线程上执行 worker序号为0 第k个并行的pass的worker序号为k
+ * pass的执行函数按worker序号取各自的光栅化器等不能共用的对象 需要共享顶点缓存的pass尽量排在各波的最前面
+ * Compile之后buffer的地址就固定了 可以交给shader保存
+ */
+class RenderGraph {
+public:
+    typedef int Handle;
+
+    enum ResourceType {
+        RESOURCE_COLOR = 0,     // ColorBuffer
+        RESOURCE_DEPTH          // DepthBuffer
+    };
+
+    class PassBuilder {
+        friend class RenderGraph;
+        RenderGraph* m_Graph;
+        int m_Pass;
+        PassBuilder(RenderGraph* graph, int pass) : m_Graph(graph), m_Pass(pass) {}
+
+    public:
+        Handle Read(Handle h);
+        Handle Write(Handle h);     // 读写都要的buffer(比如深度测试)声明Write即可
+    };
+
+    typedef std::function<void(PassBuilder&)> SetupFunc;
+    typedef std::function<void(int worker)> ExecuteFunc;
+
+private:
+    struct Resource {
+        std::string name;
+        ResourceType type;
+        ColorBuffer::Format format;     // 只对颜色buffer有效
+        int samples;                    // 每个像素的采样点数
+        ColorBuffer* externalColor;     // 外部传入的buffer 不参与复用和清空
+        DepthBuffer* externalDepth;
+        int physical = -1;              // transient buffer实际使用的内存序号
+        int firstWave = -1, lastWave = -1;
+    };
+
+    struct Pass {
+        std::string name;
+        ExecuteFunc execute;
+        std::vector<Handle> reads, writes;
+        int wave = 0;
+    };
+
+    struct PhysicalBuffer {
+        ResourceType type;
+        ColorBuffer::Format format;
+        int samples;
+        ColorBuffer* color = nullptr;
+        DepthBuffer* depth = nullptr;
+        int lastWave = -1;
+    };
+
+    int m_Width, m_Height;
+    std::vector<Resource> m_Resources;
+    std::vector<Pass> m_Passes;
+    std::vector<PhysicalBuffer> m_Physical;
+    std::vector<std::vector<int> > m_Waves;     // 每一波的pass序号 按AddPass顺序
+    std::vector<std::vector<Handle> > m_ClearBeforeWave;
+    std::vector<std::vector<Handle> > m_ResolveBeforeWave;  // 这一波要采样的buffer
+    bool m_Compiled = false;
+    bool m_Parallel = true;
+    float m_DepthClearValue;
+
+    Handle AddResource(const char* name, ResourceType type, ColorBuffer* externalColor, DepthBuffer* externalDepth);
+    void ReleasePhysical();
+    void ClearResource(Handle h);
+    void ResolveResource(Handle h);
+    void RunWave(int wave);
+
+public:
+    RenderGraph(int width, int height, float depthClearValue);
+    ~RenderGraph();
+
+    Handle ImportColor(const char* name, ColorBuffer* buffer);    // 外部持有的buffer 比如最终显示的color buffer
+    Handle ImportDepth(const char* name, DepthBuffer* buffer);     // 外部持有的深度 比如跨帧缓存的shadow map 由pass自己决定何时清空
+    Handle CreateColor(const char* name, ColorBuffer::Format format = ColorBuffer::FORMAT_RGBA8, int samples = 1);
+    Handle CreateDepth(const char* name, int samples = 1);
+    void AddPass(const char* name, const SetupFunc& setup, const ExecuteFunc& execute);
+
+    void Compile();                         // 分波 分配transient buffer 只需要在pass改变后调用一次
+    void Execute();                         // 执行一帧
+    void SetParallel(bool parallel) { m_Parallel = parallel; }     // false时所有pass按声明顺序在调用线程上执行
+
+    ColorBuffer* Color(Handle h) const;
+    DepthBuffer* Depth(Handle h) const;
+    int WorkerCount() const;                // 同一波中最多的pass数
+    int WaveCount() const { return m_Waves.size(); }
+    size_t TransientBytes() const;          // transient buffer实际占用的内存
+};
+
+#endif // RENDERGRAPH_H
@@ -1,108 +1,224 @@
 #include "shader.h"
+#include <atomic>
+#include <cstdint>
+#include <cmath>
+#ifdef RASTER_SSE2
+#include <emmintrin.h>
+#endif
+
+void ShaderUniforms::SetTransforms(const mat4x4& model, const mat4x4& rawView, const mat4x4& rawProj) {
+    modelMatrix = model;
+    modelInverseTransposeMatrix = model.invert_transpose();
 
-mat4x4 MODEL_MATRIX;
-mat4x4 MODEL_INVERSE_TRANSPOSE_MATRIX;      // model的逆转置矩阵
-mat4x4 VIEW_MATRIX;
-mat4x4 V_TRANSPOSE_MATRIX;
-mat4x4 V_INVERSE_MATRIX;
-mat4x4 MV_INVERSE_TRANSPOSE_MATRIX;         // (view * model)的逆转置矩阵
-mat4x4 PROJ_MATRIX;
-mat4x4 VP_MATRIX;
-vec4 LIGHT0;
-std::vector<ShaderLight> LIGHTS;                   // 光源信息数组
-vec3 CAMERA_POS;
-vec4 _ProjectionParams;                      // x=1.0(或-1.0 表示y反转了) y=1/near z=1/far w=(1/far-1/near)
-vec2 RT_RESOLUTION;
-
-void SetModelMatrix(mat4x4& mat) {
-    MODEL_MATRIX = mat;
-    MODEL_INVERSE_TRANSPOSE_MATRIX = mat.invert_transpose();
-}
-
-void SetViewMatrix(const mat4x4& mat) {
     // 从世界坐标的左手系变为view空间的右手系需要将z反转
-    VIEW_MATRIX = mat;
-    VIEW_MATRIX[2][0] = -VIEW_MATRIX[2][0];
-    VIEW_MATRIX[2][1] = -VIEW_MATRIX[2][1];
-    VIEW_MATRIX[2][2] = -VIEW_MATRIX[2][2];
-    VIEW_MATRIX[2][3] = -VIEW_MATRIX[2][3];
+    viewMatrix = rawView;
+    viewMatrix[2][0] = -viewMatrix[2][0];
+    viewMatrix[2][1] = -viewMatrix[2][1];
+    viewMatrix[2][2] = -viewMatrix[2][2];
+    viewMatrix[2][3] = -viewMatrix[2][3];
+    vInverseMatrix = viewMatrix.invert();
+    mvInverseTransposeMatrix = (viewMatrix * modelMatrix).invert_transpose();
+
+    // opengl范式的投影矩阵[znear, zfar]->[-1, 1] 更改映射[znear, zfar]->[1, 0]
+    mat4x4 projPrefix = mat4x4::identity();
+    projPrefix[1][1] = -1.f;    // reverse Y 因为屏幕坐标是以左上角为原点
+    projPrefix[2][2] = -0.5f;
+    projPrefix[2][3] = 0.5f;
+
+    // 计算并更新projection params
+    projectionParams.x = -1.f;
+    projectionParams.y = (rawProj[2][2] - 1.f) / rawProj[2][3];              // 1/near
+    projectionParams.z = (rawProj[2][2] + 1.f) / rawProj[2][3];              // 1/far
+    projectionParams.w = projectionParams.z - projectionParams.y;           // 1/far-1/near
 
-    MV_INVERSE_TRANSPOSE_MATRIX = (VIEW_MATRIX * MODEL_MATRIX).invert_transpose();
-    V_TRANSPOSE_MATRIX = VIEW_MATRIX.transpose();
-    V_INVERSE_MATRIX = VIEW_MATRIX.invert();
+    projMatrix = projPrefix * rawProj;
+    vpMatrix = projMatrix * viewMatrix;
 }
 
-void SetViewMatrix(const vec3& cameraPos, const mat4x4& lookAtMat) {
-    mat4x4 translateMat = mat4x4::identity();
-    translateMat[0][3] = -cameraPos.x;
-    translateMat[1][3] = -cameraPos.y;
-    translateMat[2][3] = -cameraPos.z;
+vec4 ObjectToClipPos(const ShaderUniforms& u, const vec3& v) {
+    return u.vpMatrix * (u.modelMatrix * embed<4>(v));
+}
 
-    // 先将相机坐标系平移到原点 然后旋转
-    mat4x4 view = lookAtMat * translateMat;
-    SetViewMatrix(view);
+#ifdef RASTER_SSE2
+// 4个顶点同时乘矩阵 累加顺序与mat * vec相同(从最后一列往前加) 保证和标量版本逐位相同
+static void TransformBatch4(const mat4x4& m, const __m128* in, __m128* out) {
+    for (int r = 0; r < 4; ++r) {
+        __m128 acc = _mm_setzero_ps();
+        for (int c = 4; c--; ) {
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(m[r][c]), in[c]));
+        }
+        out[r] = acc;
+    }
 }
+#endif
 
-void SetProjectionMatrix(const mat4x4& mat) {
-    static mat4x4 projPrefix = mat4x4::identity();
-    static bool isPrefixInit = false;
+void ObjectToClipPosBatch(const ShaderUniforms& u, const vec3* pos, int n, float* clipX, float* clipY, float* clipZ, float* clipW) {
+    int i = 0;
+#ifdef RASTER_SSE2
+    for (; i + 4 <= n; i += 4) {
+        __m128 objPos[4], worldPos[4], clipPos[4];
+        objPos[0] = _mm_setr_ps(pos[i].x, pos[i + 1].x, pos[i + 2].x, pos[i + 3].x);
+        objPos[1] = _mm_setr_ps(pos[i].y, pos[i + 1].y, pos[i + 2].y, pos[i + 3].y);
+        objPos[2] = _mm_setr_ps(pos[i].z, pos[i + 1].z, pos[i + 2].z, pos[i + 3].z);
+        objPos[3] = _mm_set1_ps(1.f);
+        TransformBatch4(u.modelMatrix, objPos, worldPos);
+        TransformBatch4(u.vpMatrix, worldPos, clipPos);
+        _mm_storeu_ps(clipX + i, clipPos[0]);
+        _mm_storeu_ps(clipY + i, clipPos[1]);
+        _mm_storeu_ps(clipZ + i, clipPos[2]);
+        _mm_storeu_ps(clipW + i, clipPos[3]);
+    }
+#endif
+    for (; i < n; ++i) {
+        vec4 clipPos = ObjectToClipPos(u, pos[i]);
+        clipX[i] = clipPos.x;
+        clipY[i] = clipPos.y;
+        clipZ[i] = clipPos.z;
+        clipW[i] = clipPos.w;
+    }
+}
 
-    // opengl范式的投影矩阵[znear, zfar]->[-1, 1] 更改映射[znear, zfar]->[1, 0]
-    if (!isPrefixInit) {
-        projPrefix[1][1] = -1.f;    // reverse Y 因为屏幕坐标是以左上角为原点
-        projPrefix[2][2] = -0.5f;
-        projPrefix[2][3] = 0.5f;
-        isPrefixInit = true;
+void InterpolateBatch(const void* varyings, int varyingSize, const float (*bar)[FRAGMENT_BATCH_SIZE], int mask, void* out) {
+    int nfloat = varyingSize / sizeof(float);
+    const float* v0 = static_cast<const float*>(varyings);
+    const float* v1 = v0 + nfloat;
+    const float* v2 = v1 + nfloat;
+    float* o = static_cast<float*>(out);
+
+#ifdef RASTER_SSE2
+    __m128 b[3][FRAGMENT_BATCH_SIZE / 4];
+    for (int i = 0; i < 3; ++i) {
+        for (int g = 0; g < FRAGMENT_BATCH_SIZE / 4; ++g) {
+            b[i][g] = _mm_loadu_ps(bar[i] + 4 * g);
+        }
+    }
+    for (int f = 0; f < nfloat; ++f) {
+        __m128 a0 = _mm_set1_ps(v0[f]), a1 = _mm_set1_ps(v1[f]), a2 = _mm_set1_ps(v2[f]);
+        float lanes[FRAGMENT_BATCH_SIZE];
+        for (int g = 0; g < FRAGMENT_BATCH_SIZE / 4; ++g) {
+            __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(b[0][g], a0), _mm_mul_ps(b[1][g], a1)), _mm_mul_ps(b[2][g], a2));
+            _mm_storeu_ps(lanes + 4 * g, r);
+        }
+        for (int k = 0; k < FRAGMENT_BATCH_SIZE; ++k) {
+            if (mask & (1 << k)) {
+                o[k * nfloat + f] = lanes[k];
+            }
+        }
     }
+#else
+    for (int k = 0; k < FRAGMENT_BATCH_SIZE; ++k) {
+        if (!(mask & (1 << k))) {
+            continue;
+        }
+        for (int f = 0; f < nfloat; ++f) {
+            o[k * nfloat + f] = bar[0][k] * v0[f] + bar[1][k] * v1[f] + bar[2][k] * v2[f];
+        }
+    }
+#endif
+}
 
-    // 计算并更新projection params
-    _ProjectionParams.x = -1.f;
-    _ProjectionParams.y = (mat[2][2] - 1.f) / mat[2][3];                // 1/near
-    _ProjectionParams.z = (mat[2][2] + 1.f) / mat[2][3];                // 1/far
-    _ProjectionParams.w = _ProjectionParams.z - _ProjectionParams.y;    // 1/far-1/near
+void IShader::VertexBatch(const int* corners, int n, const VertexBatchOutput& out) {
+    for (int i = 0; i < n; ++i) {
+        vec4 clipPos = Vertex(corners[i] / 3, corners[i] % 3, out.varyings != nullptr ? out.varyings[i] : nullptr);
+        if (out.clipX != nullptr) {
+            out.clipX[i] = clipPos.x;
+            out.clipY[i] = clipPos.y;
+            out.clipZ[i] = clipPos.z;
+            out.clipW[i] = clipPos.w;
+        }
+    }
+}
 
-    PROJ_MATRIX = projPrefix * mat;
-    VP_MATRIX = PROJ_MATRIX * VIEW_MATRIX;
+int IShader::FragmentBatch(const void* varyings, const float (*bar)[FRAGMENT_BATCH_SIZE], int mask, QRgb* outColors) {
+    int discardMask = 0;
+    for (int k = 0; k < FRAGMENT_BATCH_SIZE; ++k) {
+        if ((mask & (1 << k)) && Fragment(varyings, vec3(bar[0][k], bar[1][k], bar[2][k]), outColors[k])) {
+            discardMask |= 1 << k;
+        }
+    }
+    return discardMask;
 }
 
-void SetCameraAndLight(vec3 cameraPos, vec4 light) {
-    CAMERA_POS = cameraPos;
-    LIGHT0 = light;
+bool IShader::FragmentHDR(const void* varyings, vec3 barycentric, vec4& outColor) {
+    QRgb color;
+    bool discard = Fragment(varyings, barycentric, color);
+    outColor = vec4(((color >> 16) & 0xff) / 255.f, ((color >> 8) & 0xff) / 255.f, (color & 0xff) / 255.f, ((color >> 24) & 0xff) / 255.f);
+    return discard;
 }
 
-void SetLightArray(const ShaderLight* lights, int n) {
-    LIGHTS.clear();
-    for (int i = 0; i < n; ++i) {
-        LIGHTS.push_back(lights[i]);
+int IShader::FragmentBatchHDR(const void* varyings, const float (*bar)[FRAGMENT_BATCH_SIZE], int mask, vec4* outColors) {
+    int discardMask = 0;
+    for (int k = 0; k < FRAGMENT_BATCH_SIZE; ++k) {
+        if ((mask & (1 << k)) && FragmentHDR(varyings, vec3(bar[0][k], bar[1][k], bar[2][k]), outColors[k])) {
+            discardMask |= 1 << k;
+        }
+    }
+    return discardMask;
+}
+
+static std::atomic<unsigned> randomSeed(1);
+static std::atomic<unsigned> randomGeneration(1);     // 每次SeedShaderRandom加一 线程据此发现种子变了
+static std::atomic<unsigned> randomStream(0);         // 给每个线程分配不同的序列
+
+struct ShaderRandomState {
+    unsigned generation = 0;
+    uint32_t state = 0;
+};
+static thread_local ShaderRandomState threadRandom;
+
+// 把种子打散 相邻的种子也能得到不相关的初始状态
+static uint32_t HashSeed(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+float ShaderRandom01() {
+    ShaderRandomState& r = threadRandom;
+    unsigned generation = randomGeneration.load(std::memory_order_relaxed);
+    if (r.generation != generation) {
+        r.generation = generation;
+        r.state = HashSeed(randomSeed.load(std::memory_order_relaxed) + 0x9e3779b9u * ++randomStream);
+        if (r.state == 0) {
+            r.state = 1;
+        }
     }
+    // xorshift32
+    r.state ^= r.state << 13;
+    r.state ^= r.state >> 17;
+    r.state ^= r.state << 5;
+    return (r.state >> 8) * (1.f / 16777216.f);
 }
 
-void SetRenderTargetResolution(int width, int height) {
-    RT_RESOLUTION[0] = width;
-    RT_RESOLUTION[1] = height;
+void SeedShaderRandom(unsigned seed) {
+    randomSeed = seed;
+    ++randomGeneration;
 }
 
-vec3 NormalObjectToWorld(const vec3& n) {
-    return proj<3>(MODEL_INVERSE_TRANSPOSE_MATRIX * embed<4>(n, 0));
+vec3 NormalObjectToWorld(const ShaderUniforms& u, const vec3& n) {
+    return proj<3>(u.modelInverseTransposeMatrix * embed<4>(n, 0));
 }
 
-vec3 NormalObjectToView(const vec3& n) {
-    return proj<3>(MV_INVERSE_TRANSPOSE_MATRIX * embed<4>(n, 0));
+vec3 NormalObjectToView(const ShaderUniforms& u, const vec3& n) {
+    return proj<3>(u.mvInverseTransposeMatrix * embed<4>(n, 0));
 }
 
-vec3 CoordNDCToView(const vec3& p) {
+vec3 CoordNDCToView(const ShaderUniforms& u, const vec3& p) {
     vec3 ret;
-    ret.z = 1.f / (_ProjectionParams.w * p.z - _ProjectionParams.z);
-    ret.x = -p.x * ret.z / PROJ_MATRIX[0][0];
-    ret.y = -p.y * ret.z / PROJ_MATRIX[1][1];
+    ret.z = 1.f / (u.projectionParams.w * p.z - u.projectionParams.z);
+    ret.x = -p.x * ret.z / u.projMatrix[0][0];
+    ret.y = -p.y * ret.z / u.projMatrix[1][1];
     return ret;
 }
 
-vec3 CoordNDCToView(vec3 p, int) {
+vec3 CoordNDCToView(const ShaderUniforms& u, vec3 p, int) {
     vec3 ret;
-    ret.z = 1.f / (_ProjectionParams.w * p.z - _ProjectionParams.z);
-    ret.x = -p.x * ret.z / PROJ_MATRIX[0][0];
-    ret.y = -p.y * ret.z / PROJ_MATRIX[1][1];
+    ret.z = 1.f / (u.projectionParams.w * p.z - u.projectionParams.z);
+    ret.x = -p.x * ret.z / u.projMatrix[0][0];
+    ret.y = -p.y * ret.z / u.projMatrix[1][1];
     return ret;
 }
 
@@ -114,6 +230,46 @@ vec3 GetNDC(vec2 ndcXY, float* zbuffer, int zbufferWidth, int zbufferHeight) {
     return ret;
 }
 
+float ShadowPCF(const float* shadowMap, int width, int height, float u, float v, float z, int radius) {
+    int cx = (int)std::floor(u * width), cy = (int)std::floor(v * height);
+    int taps = 2 * radius + 1;
+    int minX = cx - radius, minY = cy - radius;
+
+#ifdef RASTER_SSE2
+    // 一行最多8个tap 分两组4个一起比较 窗口要完整落在shadow map内 多读的tap不能越界
+    int span = taps > 4 ? 8 : 4;
+    if (taps <= 8 && minX >= 0 && minX + span <= width && minY >= 0 && minY + taps <= height) {
+        __m128 zv = _mm_set1_ps(z);
+        __m128 one = _mm_set1_ps(1.f);
+        __m128 laneLo = _mm_castsi128_ps(_mm_setr_epi32(-(taps > 0), -(taps > 1), -(taps > 2), -(taps > 3)));
+        __m128 laneHi = _mm_castsi128_ps(_mm_setr_epi32(-(taps > 4), -(taps > 5), -(taps > 6), -(taps > 7)));
+        __m128 lit = _mm_setzero_ps();
+        for (int y = minY; y < minY + taps; ++y) {
+            const float* row = shadowMap + minX + y * width;
+            __m128 cmp = _mm_and_ps(_mm_cmpgt_ps(zv, _mm_loadu_ps(row)), laneLo);
+            lit = _mm_add_ps(lit, _mm_and_ps(cmp, one));
+            if (span > 4) {
+                cmp = _mm_and_ps(_mm_cmpgt_ps(zv, _mm_loadu_ps(row + 4)), laneHi);
+                lit = _mm_add_ps(lit, _mm_and_ps(cmp, one));
+            }
+        }
+        float sum[4];
+        _mm_storeu_ps(sum, lit);
+        return (sum[0] + sum[1] + sum[2] + sum[3]) / (taps * taps);
+    }
+#endif
+
+    int lit = 0;
+    for (int y = minY; y < minY + taps; ++y) {
+        for (int x = minX; x < minX + taps; ++x) {
+            if (x < 0 || x >= width || y < 0 || y >= height || z > shadowMap[x + y * width]) {
+                ++lit;
+            }
+        }
+    }
+    return (float)lit / (taps * taps);
+}
+
 /* in  normal
  *   \ |\
  *   _\|
@@ -145,3 +301,18 @@ vec3 Refract(const vec3& inLightDir, vec3 normal, float refractiveIndex) {
     // 当rate>1时 有一段是全反射而没有折射 因此此时折射角不存在 返回一个标记值
     return (cosOutSqr < 0) ? vec3(2, 0, 0) : (rate * inLightDir + (rate * cosIn - std::sqrt(cosOutSqr)) * normal).normalize();
 }
+
+// 程序启动时建好 不用函数内static 避免每个像素都查初始化标记
+static struct SRGBTable {
+    float value[256];
+    SRGBTable() {
+        for (int i = 0; i < 256; ++i) {
+            float v = i / 255.f;
+            value[i] = v <= 0.04045f ? v / 12.92f : std::pow((v + 0.055f) / 1.055f, 2.4f);
+        }
+    }
+} srgbTable;
+
+float SRGBToLinear(uint8_t c) {
+    return srgbTable.value[c];
+}
@@ -7,9 +7,13 @@
 #include "accel.h"
 #include "skybox.h"
 #include "world.h"
+#include "colorbuffer.h"
 #include <QRgb>
 #include <QImage>
 #include <cstdlib>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
 
 ///////////////////////////////////////// SHADER ENV ////////////////////////////
 
@@ -19,56 +23,138 @@ struct ShaderLight {
     float intensity;
 };
 
-extern mat4x4 MODEL_MATRIX;                         // model to world
-extern mat4x4 MODEL_INVERSE_TRANSPOSE_MATRIX;       // model的逆转置矩阵
-extern mat4x4 VIEW_MATRIX;                          // world to view
-extern mat4x4 V_TRANSPOSE_MATRIX;
-extern mat4x4 V_INVERSE_MATRIX;
-extern mat4x4 MV_INVERSE_TRANSPOSE_MATRIX;
-extern mat4x4 PROJ_MATRIX;                          // view to clip space
-extern mat4x4 VP_MATRIX;                            // proj * view
-extern vec4 LIGHT0;                                 // 向量或位置 区别在于w分量1or0
-extern std::vector<ShaderLight> LIGHTS;
-extern vec3 CAMERA_POS;
-extern vec4 _ProjectionParams;                      // x=1.0(或-1.0 表示y反转了) y=1/near z=1/far w=(1/far-1/near)
-extern vec2 RT_RESOLUTION;                          // resolution of render target [0]:width [1]:height
-
-void SetModelMatrix(mat4x4& mat);
-void SetViewMatrix(const mat4x4& mat);
-void SetViewMatrix(const vec3& cameraPos, const mat4x4& lookAtMat);
-void SetProjectionMatrix(const mat4x4& mat);
-void SetCameraAndLight(vec3 cameraPos, vec4 light);
-void SetLightArray(const ShaderLight* lights, int n);
-void SetRenderTargetResolution(int width, int height);
-vec3 NormalObjectToWorld(const vec3& n);
-vec3 NormalObjectToView(const vec3& n);
-vec3 CoordNDCToView(const vec3& p);
-vec3 CoordNDCToView(vec3 p, int);           // int 用于区分参数是否引用
+/* 一次draw用到的变换和光照参数 draw之前准备好 draw期间只读
+ * 每个视角(相机 光源)各持有一份 pass之间不再共用可变的全局状态 可以先把各pass的uniform都准备好再执行
+ */
+struct ShaderUniforms {
+    mat4x4 modelMatrix;                     // model to world
+    mat4x4 modelInverseTransposeMatrix;     // model的逆转置矩阵
+    mat4x4 viewMatrix;                      // world to view
+    mat4x4 vInverseMatrix;
+    mat4x4 mvInverseTransposeMatrix;        // (view * model)的逆转置矩阵
+    mat4x4 projMatrix;                      // view to clip space
+    mat4x4 vpMatrix;                        // proj * view
+    mat4x4 lightVPMatrix;                   // 光源视角的vpMatrix 采样shadow map用 和画shadow map的矩阵是同一个
+    vec4 projectionParams;                  // x=1.0(或-1.0 表示y反转了) y=1/near z=1/far w=(1/far-1/near)
+    vec4 light0;                            // 向量或位置 区别在于w分量1or0
+    std::vector<ShaderLight> lights;
+    vec3 cameraPos;
+    vec2 rtResolution;                      // resolution of render target [0]:width [1]:height
+
+    // 传入相机/光源的原始view和投影矩阵 转换成shader使用的约定 派生的逆矩阵等在这里一次算好
+    void SetTransforms(const mat4x4& model, const mat4x4& rawView, const mat4x4& rawProj);
+};
+
+vec4 ObjectToClipPos(const ShaderUniforms& u, const vec3& v);      // 所有pass都用它算clip坐标 保证深度prepass和EQUAL测试的深度逐位相同
+vec3 NormalObjectToWorld(const ShaderUniforms& u, const vec3& n);
+vec3 NormalObjectToView(const ShaderUniforms& u, const vec3& n);
+vec3 CoordNDCToView(const ShaderUniforms& u, const vec3& p);
+vec3 CoordNDCToView(const ShaderUniforms& u, vec3 p, int);        // int 用于区分参数是否引用
 vec3 GetNDC(vec2 ndcXY, float* zbuffer, int zbufferWidth, int zbufferHeight);
+// shadow map的percentage-closer filtering 返回uv周围(2*radius+1)^2个tap中深度z比shadow map近的比例
+// z需要已经加上bias radius为0时就是一次比较 超出shadow map的tap当作没有遮挡
+float ShadowPCF(const float* shadowMap, int width, int height, float u, float v, float z, int radius);
 vec3 Reflect(const vec3& inLightDir, const vec3& normal);
 vec3 Refract(const vec3& inLightDir, vec3 normal, float refractiveIndex);
 
+const int VERTEX_BATCH_SIZE = 64;           // VertexBatch一次最多处理的顶点
+const int FRAGMENT_BATCH_SIZE = 8;          // FragmentBatch一次最多处理的像素 光栅化时8x8块的一行
+
+// VertexBatch的输出 clip坐标按SoA存放 clipX为nullptr时表示不需要clip坐标(顶点缓存已经算好)
+struct VertexBatchOutput {
+    float* clipX = nullptr;
+    float* clipY = nullptr;
+    float* clipZ = nullptr;
+    float* clipW = nullptr;
+    void* const* varyings = nullptr;        // 第i个顶点的v2f写到varyings[i] 没有varying时为nullptr
+};
+
+// 批量版本的ObjectToClipPos SSE2每次变换4个顶点 运算顺序和标量版本一致 结果逐位相同
+void ObjectToClipPosBatch(const ShaderUniforms& u, const vec3* pos, int n, float* clipX, float* clipY, float* clipZ, float* clipW);
+// 用重心坐标插值三角形三个顶点的v2f(当作float数组) mask中像素k的结果写到out + k * varyingSize
+void InterpolateBatch(const void* varyings, int varyingSize, const float (*bar)[FRAGMENT_BATCH_SIZE], int mask, void* out);
+
+// 线程各自独立的随机数 [0, 1) 多线程着色时代替std::rand(共用状态 加锁或数据竞争)
+float ShaderRandom01();
+void SeedShaderRandom(unsigned seed);       // 之后各线程第一次取随机数时按新种子重新初始化
+
+float SRGBToLinear(uint8_t c);              // 查表 贴图里的8bit sRGB颜色转线性空间 [0, 1]
+
 /////////////////////////////////////////////////////////////////////////////////
 
+/* 同一个shader对象会被多个线程同时调用(每个tile一个线程)
+ * 顶点数据都通过参数传递 Vertex/Geometry/Fragment中不能写成员变量或函数内static变量
+ * 需要随机数时用ShaderRandom01 每个线程有自己的随机数状态
+ */
 class IShader {
 public:
     virtual ~IShader() {};
-    virtual vec4 Vertex(int iface, int nthvert) = 0;
-    virtual void Geometry() {};     // 几何着色器可以拿到完整的图元和图元所有的顶点 修改顶点数据（目前功能）或增添顶点（暂且没做）
-    virtual bool Fragment(vec3 barycentric, QRgb& outColor) = 0;
+    // varyings是该顶点v2f的写入位置 由调用者提供 VaryingSize()为0时是nullptr
+    virtual vec4 Vertex(int iface, int nthvert, void* varyings) = 0;
+    // 几何着色器可以拿到完整的图元和图元所有的顶点 修改顶点数据（目前功能）或增添顶点（暂且没做）
+    // varyings是该三角形三个顶点连续存放的v2f 是调用者的拷贝 共用的顶点不会被改掉
+    virtual void Geometry(void* /*varyings*/) {};
+    // varyings是光栅化器保存下来的该三角形三个顶点的v2f
+    virtual bool Fragment(const void* varyings, vec3 barycentric, QRgb& outColor) = 0;
+
+    // v2f只能由float组成(vec mat) 裁剪时会把它当作float数组线性插值出新顶点
+    virtual int VaryingSize() const { return 0; }               // 单个顶点v2f的字节数
+    virtual bool HasGeometry() const { return false; }          // 是否重写了Geometry 没有的话顶点缓存里的v2f可以直接提交
+    virtual bool DepthOnly() const { return false; }            // 片元阶段不输出颜色也不discard 没有render target时光栅化器直接写深度 不调用Fragment
+
+    void SetUniforms(const ShaderUniforms* u) { uniforms = u; }     // draw开始时设置 指向的数据在draw期间不能改
+
+    // 批量接口 默认逐个调用Vertex/Fragment 重写后可以跨顶点/像素做SIMD
+    // corners[i] = iface * 3 + nthvert 第i个顶点的结果写到out的第i项
+    virtual void VertexBatch(const int* corners, int n, const VertexBatchOutput& out);
+    // 同一个三角形同一行的最多FRAGMENT_BATCH_SIZE个像素 mask第k位为1的像素需要着色 bar[i][k]是像素k的第i个重心坐标
+    // 返回被discard的像素mask
+    virtual int FragmentBatch(const void* varyings, const float (*bar)[FRAGMENT_BATCH_SIZE], int mask, QRgb* outColors);
+
+    // 写浮点render target时代替Fragment/FragmentBatch 输出线性空间的颜色 不clamp不量化
+    // 默认把Fragment输出的8bit颜色换算成[0, 1] 只有需要HDR输出的shader才重写
+    virtual bool FragmentHDR(const void* varyings, vec3 barycentric, vec4& outColor);
+    virtual int FragmentBatchHDR(const void* varyings, const float (*bar)[FRAGMENT_BATCH_SIZE], int mask, vec4* outColors);
+
+protected:
+    const ShaderUniforms* uniforms = nullptr;
+};
+
+/* CRTP基类 没有原生批量实现的shader继承它
+ * FragmentBatch直接调用Derived::Fragment 光栅化器按具体shader类型实例化时整个循环可以内联
+ * 具体shader最好声明为final 这样光栅化器对FragmentBatch的调用也不用走虚函数表
+ */
+template<class Derived>
+class ShaderBase : public IShader {
+public:
+    virtual int FragmentBatch(const void* varyings, const float (*bar)[FRAGMENT_BATCH_SIZE], int mask, QRgb* outColors) override {
+        Derived* self = static_cast<Derived*>(this);
+        int discardMask = 0;
+        for (int k = 0; k < FRAGMENT_BATCH_SIZE; ++k) {
+            if ((mask & (1 << k)) && self->Derived::Fragment(varyings, vec3(bar[0][k], bar[1][k], bar[2][k]), outColors[k])) {
+                discardMask |= 1 << k;
+            }
+        }
+        return discardMask;
+    }
 };
 
-class GeneralShader : public IShader {
+class GeneralShader final : public IShader {
     TGAImage* diffuseTexture;
     TGAImage* normalTexture;
     TGAImage* specTexture;
-    QImage* shadowMap;
-    QImage* AOMap;      // 环境光遮蔽贴图
+    const float* shadowMap;     // 光源视角的深度 与光源空间ndc的z直接比较
+    const ColorBuffer* AOMap = nullptr;     // 环境光遮蔽 render graph的transient buffer 每次draw前由SetAOMap设置
     Model* model;
     vec3 lightColor;
     float specStrength;
-    mat4x4 world2Light;
     float shadowBias;
+    int shadowPCFRadius;        // 0: 一次比较 1: 3x3 2: 5x5
+    int diffuseWidth, diffuseHeight;        // 贴图尺寸 构造时读出来 避免每个像素都查函数内static的初始化标记
+    int normalWidth, normalHeight;
+    int specWidth, specHeight;
+    int shadowMapWidth, shadowMapHeight;
+    int AOMapWidth, AOMapHeight;
 
     struct v2f {
         vec3 normal;
@@ -80,14 +166,21 @@ class GeneralShader : public IShader {
         vec4 clipPos;
     };
 
-    v2f vertOutput[3];
-
  public:
-    GeneralShader(Model* _model, TGAImage* _diffuseTexture, TGAImage* _normalTexture, TGAImage* _specTexture, QImage* _shadowMap, const mat4x4& _world2Light, QImage* _AOMap, vec3 _lightColor = {1, 1, 1}, float _specStrength = 16.f, float _shadowBias = 0.02f) :
+    GeneralShader(Model* _model, TGAImage* _diffuseTexture, TGAImage* _normalTexture, TGAImage* _specTexture,
+                  const float* _shadowMap, int _shadowMapWidth, int _shadowMapHeight,
+                  vec3 _lightColor = {1, 1, 1}, float _specStrength = 16.f, float _shadowBias = 0.02f, int _shadowPCFRadius = 1) :
         model(_model), diffuseTexture(_diffuseTexture), normalTexture(_normalTexture), specTexture(_specTexture),
-        shadowMap(_shadowMap), world2Light(_world2Light), AOMap(_AOMap), lightColor(_lightColor), specStrength(_specStrength),
-        shadowBias(_shadowBias)
-    {}
+        shadowMap(_shadowMap), lightColor(_lightColor), specStrength(_specStrength),
+        shadowBias(_shadowBias), shadowPCFRadius(_shadowPCFRadius), shadowMapWidth(_shadowMapWidth), shadowMapHeight(_shadowMapHeight)
+    {
+        diffuseWidth = diffuseTexture->get_width();
+        diffuseHeight = diffuseTexture->get_height();
+        normalWidth = normalTexture->get_width();
+        normalHeight = normalTexture->get_height();
+        specWidth = specTexture->get_width();
+        specHeight = specTexture->get_height();
+    }
 
     virtual ~GeneralShader() {
         delete diffuseTexture;
@@ -95,19 +188,58 @@ class GeneralShader : public IShader {
         delete specTexture;
     };
 
-    virtual vec4 Vertex(int iface, int nthvert) override {
-        v2f o;
-        o.normal = NormalObjectToWorld(model->normal(iface, nthvert)).normalize();
+    // AO贴图的内存由render graph管理 可能和其他transient buffer共用 只在读它的pass执行期间有效
+    // 所以不在构造时保存 每次draw之前从graph取出来设置
+    void SetAOMap(const ColorBuffer* _AOMap) {
+        AOMap = _AOMap;
+        AOMapWidth = AOMap->Width();
+        AOMapHeight = AOMap->Height();
+    }
+
+    virtual int VaryingSize() const override {
+        return sizeof(v2f);
+    }
+
+    virtual vec4 Vertex(int iface, int nthvert, void* varyings) override {
+        v2f& o = *static_cast<v2f*>(varyings);
+        o.normal = NormalObjectToWorld(*uniforms, model->normal(iface, nthvert)).normalize();
         o.uv = model->uv(iface, nthvert);
-        vec4 worldPos = MODEL_MATRIX * embed<4>(model->vert(iface, nthvert));
-        o.worldPos = proj<3>(worldPos);
-        o.clipPos = VP_MATRIX * worldPos;
-        vertOutput[nthvert] = o;
+        o.worldPos = proj<3>(uniforms->modelMatrix * embed<4>(model->vert(iface, nthvert)));
+        o.clipPos = ObjectToClipPos(*uniforms, model->vert(iface, nthvert));
 
         return o.clipPos;
     }
 
-    virtual void Geometry() override {
+    // clip坐标用SSE批量变换 法线 uv和世界坐标逐个计算
+    virtual void VertexBatch(const int* corners, int n, const VertexBatchOutput& out) override {
+        vec3 pos[VERTEX_BATCH_SIZE];
+        float clip[4][VERTEX_BATCH_SIZE];
+        for (int i = 0; i < n; ++i) {
+            pos[i] = model->vert(corners[i] / 3, corners[i] % 3);
+        }
+        ObjectToClipPosBatch(*uniforms, pos, n, clip[0], clip[1], clip[2], clip[3]);
+        for (int i = 0; i < n; ++i) {
+            int iface = corners[i] / 3, nthvert = corners[i] % 3;
+            v2f& o = *static_cast<v2f*>(out.varyings[i]);
+            o.normal = NormalObjectToWorld(*uniforms, model->normal(iface, nthvert)).normalize();
+            o.uv = model->uv(iface, nthvert);
+            o.worldPos = proj<3>(uniforms->modelMatrix * embed<4>(pos[i]));
+            o.clipPos = vec4(clip[0][i], clip[1][i], clip[2][i], clip[3][i]);
+            if (out.clipX != nullptr) {
+                out.clipX[i] = o.clipPos.x;
+                out.clipY[i] = o.clipPos.y;
+                out.clipZ[i] = o.clipPos.z;
+                out.clipW[i] = o.clipPos.w;
+            }
+        }
+    }
+
+    virtual bool HasGeometry() const override {
+        return true;
+    }
+
+    virtual void Geometry(void* varyings) override {
+        v2f* vertOutput = static_cast<v2f*>(varyings);
         // 切线计算 http://blog.sina.com.cn/s/blog_15ff6002b0102y8b9.html
         vec2 uvs[3];
         for (int i = 0; i < 3; ++i) {
@@ -125,38 +257,16 @@ class GeneralShader : public IShader {
             vertOutput[i].tanToWorld.set_col(0, verTan);
             vertOutput[i].tanToWorld.set_col(1, verBitan);
             vertOutput[i].tanToWorld.set_col(2, vertOutput[i].normal);
-
-            static bool flag = false;
-            if (!flag) {
-                vec3 bitangent = prefix * ((uvs[0].x - uvs[2].x) * q0 + (uvs[1].x - uvs[0].x) * q1);
-                qDebug() << verBitan * bitangent;
-                flag = true;
-            }
         }
     }
 
-    virtual bool Fragment(vec3 barycentric, QRgb& outColor) override {
-        static int diffuseWidth = diffuseTexture->get_width();
-        static int diffuseHeight = diffuseTexture->get_height();
-        static int normalWidth = normalTexture->get_width();
-        static int normalHeight = normalTexture->get_height();
-        static int specWidth = specTexture->get_width();
-        static int specHeight = specTexture->get_height();
-        static int shadowMapWidth = shadowMap->width();
-        static int shadowMapHeight = shadowMap->height();
-        static int AOMapWidth = AOMap->width();
-        static int AOMapHeight = AOMap->height();
-
-        vec2 uv = {0, 0};
-        vec3 worldPos = {0, 0, 0};
-        vec4 clipPos = {0, 0, 0, 0};
-        mat3x3 tanToWorld = mat3x3::zero();
-        for (int i = 0; i < 3; ++i) {
-            uv = uv + barycentric[i] * vertOutput[i].uv;
-            worldPos = worldPos + barycentric[i] * vertOutput[i].worldPos;
-            tanToWorld = tanToWorld + vertOutput[i].tanToWorld * barycentric[i];
-            clipPos = clipPos + vertOutput[i].clipPos * barycentric[i];
-        }
+    // 对插值后的顶点数据着色
+    // hdr为true时贴图颜色按sRGB解码到线性空间 结果不clamp 交给后处理tone mapping
+    vec3 Shade(const v2f& i, bool hdr) {
+        const vec2& uv = i.uv;
+        const vec3& worldPos = i.worldPos;
+        const vec4& clipPos = i.clipPos;
+        const mat3x3& tanToWorld = i.tanToWorld;
         // 计算由法线贴图获取的切线空间法向量 再转换为世界空间
         TGAColor rawTanNormal = normalTexture->get(uv.x * normalWidth, uv.y * normalHeight);
         vec3 tanNormal = {rawTanNormal[2] / 255.f * 2.f - 1.f, rawTanNormal[1] / 255.f * 2.f - 1.f, rawTanNormal[0] / 255.f * 2.f - 1.f};
@@ -164,184 +274,132 @@ class GeneralShader : public IShader {
         vec2 screenPos = proj<2>(clipPos / clipPos.w);
         screenPos = 0.5f * screenPos + 0.5f;
 
-        vec3 lightDir = (LIGHT0.w == 0) ? embed<3>(LIGHT0) : (embed<3>(LIGHT0) - worldPos).normalize();
-        vec3 viewDir = (CAMERA_POS - worldPos).normalize();
+        vec3 lightDir = (uniforms->light0.w == 0) ? embed<3>(uniforms->light0) : (embed<3>(uniforms->light0) - worldPos).normalize();
+        vec3 viewDir = (uniforms->cameraPos - worldPos).normalize();
         vec3 halfDir = (lightDir + viewDir).normalize();
         // 图片加载已经经过y反转 不需要reverse y
         TGAColor rawAlbedo = diffuseTexture->get(uv.x * diffuseWidth, uv.y * diffuseHeight);
-        vec4 albedo = {rawAlbedo[2] / 255.f, rawAlbedo[1] / 255.f, rawAlbedo[0] / 255.f, rawAlbedo[3] / 255.f};
-        float ambient = 0.3f * ((AOMap->pixel(screenPos.x * AOMapWidth, screenPos.y * AOMapHeight) & 0xff) / 255.f);
+        vec4 albedo = hdr ? vec4(SRGBToLinear(rawAlbedo[2]), SRGBToLinear(rawAlbedo[1]), SRGBToLinear(rawAlbedo[0]), rawAlbedo[3] / 255.f)
+                          : vec4(rawAlbedo[2] / 255.f, rawAlbedo[1] / 255.f, rawAlbedo[0] / 255.f, rawAlbedo[3] / 255.f);
+        int AOx = std::min(std::max((int)(screenPos.x * AOMapWidth), 0), AOMapWidth - 1);
+        int AOy = std::min(std::max((int)(screenPos.y * AOMapHeight), 0), AOMapHeight - 1);
+        float ambient = 0.3f * ((AOMap->Data()[AOy * AOMapWidth + AOx] & 0xff) / 255.f);
         float diff = clamp01(worldNormal * lightDir);
         // float specPower = specTexture->get(uv.x * specWidth, uv.y * specHeight)[0] / 255.f;
         float spec = std::pow(clamp01(halfDir * worldNormal), 16);
 
         // 计算点在light空间的clip坐标 进一步得到shadow值
-        vec4 lightP = world2Light * embed<4>(worldPos);
+        vec4 lightP = uniforms->lightVPMatrix * embed<4>(worldPos);
         lightP = lightP / lightP.w;
-        // 这里不需要反转shadowMap 因为world2Light中的P_MATRIX已经将y反转过了
-        float shadow = (shadowMap->pixel((0.5f * lightP.x + 0.5f) * shadowMapWidth, (0.5f * lightP.y + 0.5f) * shadowMapHeight) & 0xff) / 255.f;
-        shadow = 0.3f + 0.7f * ((lightP.z + shadowBias) > shadow);
+        // 这里不需要反转shadowMap 因为lightVPMatrix中的P_MATRIX已经将y反转过了
+        float shadow = ShadowPCF(shadowMap, shadowMapWidth, shadowMapHeight, 0.5f * lightP.x + 0.5f, 0.5f * lightP.y + 0.5f,
+                                 lightP.z + shadowBias, shadowPCFRadius);
+        shadow = 0.3f + 0.7f * shadow;
 
-        vec3 col = clamp01((ambient + shadow * (diff + spec)) * mul(lightColor, proj<3>(albedo)));
         // col = ambient * lightColor;
-        col = col * 255.f;
-        outColor = (255 << 24) | ((uint8_t)col[0] << 16) | ((uint8_t)col[1] << 8) | ((uint8_t)col[2]);
-        return false;
+        return (ambient + shadow * (diff + spec)) * mul(lightColor, proj<3>(albedo));
     }
-};
-
-class ShadowMapShader : public IShader {
-    Model* model;
-
-    struct v2f {
-        // 不使用z/w 然后进行插值的原因在于z/w在世界空间中的变化是非线性的 因此要分别对z和w线性插值后 再做透视除法算出深度
-        vec4 clipPos;
-    };
-
-    v2f vertOutput[3];
-
-public:
-    ShadowMapShader(Model* _model) : model(_model) {}
 
-    virtual vec4 Vertex(int iface, int nthvert) override {
-        vertOutput[nthvert].clipPos = VP_MATRIX * MODEL_MATRIX * embed<4>(model->vert(iface, nthvert));
-        return vertOutput[nthvert].clipPos;
+    static QRgb PackColor(vec3 col) {
+        col = clamp01(col) * 255.f;
+        return (255 << 24) | ((uint8_t)col[0] << 16) | ((uint8_t)col[1] << 8) | ((uint8_t)col[2]);
     }
 
-    virtual bool Fragment(vec3 barycentric, QRgb& outColor) override {
-        vec4 clipPos = barycentric.x * vertOutput[0].clipPos + barycentric.y * vertOutput[1].clipPos + barycentric.z * vertOutput[2].clipPos;
-        uint8_t depthColor = (clipPos.z / clipPos.w) * 255;
-        outColor = (255 << 24) | (depthColor << 16) | (depthColor << 8) | depthColor;
+    virtual bool Fragment(const void* varyings, vec3 barycentric, QRgb& outColor) override {
+        float bar[3][FRAGMENT_BATCH_SIZE] = {{barycentric.x}, {barycentric.y}, {barycentric.z}};
+        v2f i;
+        InterpolateBatch(varyings, sizeof(v2f), bar, 1, &i);
+        outColor = PackColor(Shade(i, false));
         return false;
     }
-};
-
-/* horizon-based AO 或许可以在这里计算AO的同时计算光照颜色 */
-class HBAOShader : public IShader {
-    Model* model;
-    float* zbuffer;                 // 正宗的zbuffer 里面是经过插值的ndc空间z值 [far, near]->[0, 1]
-    int zbufferWidth, zbufferHeight;
-    float sampleRadius, sampleCount, dirCount;        // 采样半径(uv) 采样数目 方向数目
-
-    struct v2f {
-        vec3 viewNormal;
-        vec4 clipPos;               // 用于获取屏幕坐标的 和 手动zclip用的
-    };
 
-    v2f vertOutput[3];
-
-    inline float WeightFun(float w) {
-        w = clamp01(w);
-        return 1.f - w * w;
+    virtual bool FragmentHDR(const void* varyings, vec3 barycentric, vec4& outColor) override {
+        float bar[3][FRAGMENT_BATCH_SIZE] = {{barycentric.x}, {barycentric.y}, {barycentric.z}};
+        v2f i;
+        InterpolateBatch(varyings, sizeof(v2f), bar, 1, &i);
+        outColor = embed<4>(Shade(i, true));
+        return false;
     }
 
-    // 对某一方向上的occlusion进行积分
-    float CalAmbientOcclusionIntegralInOneDir(const vec3& originNDC, const vec2& dir, const vec3& normal) {
-        float totalOcclusion = 0.f;
-        float topSin = 0.03f;     // 记录积分开始的片段 从非零开始意味着忽略sinθ小于0.03的遮挡
-
-        vec3 originView = CoordNDCToView(originNDC);
-        vec2 texelSizeStep = mul(dir, vec2(2.f / zbufferWidth, 2.f / zbufferHeight));
-        vec3 tangent = CoordNDCToView(GetNDC(proj<2>(originNDC) + texelSizeStep, zbuffer, zbufferWidth, zbufferHeight), 0) - originView;
-        tangent = (tangent - (normal * tangent) * normal).normalize();
-        vec2 stepNDC = (sampleRadius / sampleCount) * dir;
-
-        // begin march
-        vec3 curSampleNDC = GetNDC(proj<2>(originNDC) + stepNDC, zbuffer, zbufferWidth, zbufferHeight);
-        for (int i = 0; i < sampleCount; ++i) {
-            // 校验NDC是否在合法范围内
-            if (curSampleNDC.x < -1 || curSampleNDC.x > 1 || curSampleNDC.y < -1 || curSampleNDC.y > 1) {
-                break;
-            }
-            // 排除采样到非物体的zbuffer
-            if (curSampleNDC.z < 0) {
-                continue;
+    // 顶点数据的插值用SSE一次算4个像素 贴图采样和光照仍逐像素计算
+    virtual int FragmentBatch(const void* varyings, const float (*bar)[FRAGMENT_BATCH_SIZE], int mask, QRgb* outColors) override {
+        v2f lanes[FRAGMENT_BATCH_SIZE];
+        InterpolateBatch(varyings, sizeof(v2f), bar, mask, lanes);
+        for (int k = 0; k < FRAGMENT_BATCH_SIZE; ++k) {
+            if (mask & (1 << k)) {
+                outColors[k] = PackColor(Shade(lanes[k], false));
             }
+        }
+        return 0;
+    }
 
-            vec3 sampleView = CoordNDCToView(curSampleNDC);
-            vec3 horizonVec = sampleView - originView;
-            float horizonVecLength = horizonVec.norm();
-
-            // 这个方向的ambient被完全遮住
-            if (tangent * horizonVec < 0) {
-                return 1.f;
+    virtual int FragmentBatchHDR(const void* varyings, const float (*bar)[FRAGMENT_BATCH_SIZE], int mask, vec4* outColors) override {
+        v2f lanes[FRAGMENT_BATCH_SIZE];
+        InterpolateBatch(varyings, sizeof(v2f), bar, mask, lanes);
+        for (int k = 0; k < FRAGMENT_BATCH_SIZE; ++k) {
+            if (mask & (1 << k)) {
+                outColors[k] = embed<4>(Shade(lanes[k], true));
             }
-            float curSin = normal * horizonVec / horizonVecLength; // sinθ
-            float diff = std::max(curSin - topSin, 0.f);
-            topSin = std::max(topSin, curSin);
+        }
+        return 0;
+    }
+};
 
-            totalOcclusion += diff * WeightFun((float)i / sampleCount);
+/* 只写深度的shader 只有顶点阶段 深度由光栅化器直接写入深度缓冲
+ * 相机的深度prepass和光源视角的shadow map只是名字不同 各自派生一个final类 光栅化器按具体类型实例化
+ */
+class DepthOnlyShader : public IShader {
+    Model* model;
 
-            curSampleNDC = GetNDC(proj<2>(curSampleNDC) + stepNDC, zbuffer, zbufferWidth, zbufferHeight);
-        }
+public:
+    DepthOnlyShader(Model* _model) : model(_model) {}
 
-        return totalOcclusion;
+    virtual bool DepthOnly() const override {
+        return true;
     }
 
- public:
-    HBAOShader(Model* _model, float* _zbuffer, int _zbufferWidth, int _zbufferHeight, float _sampleRadius = 0.2f, float _sampleCount = 5.f, float _dirCount = 6.f) :
-        model(_model), zbuffer(_zbuffer), zbufferWidth(_zbufferWidth), zbufferHeight(_zbufferHeight),
-        sampleRadius(_sampleRadius), sampleCount(_sampleCount), dirCount(_dirCount)
-    {}
-
-    virtual vec4 Vertex(int iface, int nthvert) override {
-        v2f o;
-        o.viewNormal = NormalObjectToView(model->normal(iface, nthvert)).normalize();
-        o.clipPos = VP_MATRIX * MODEL_MATRIX * embed<4>(model->vert(iface, nthvert));
-        vertOutput[nthvert] = o;
-        return o.clipPos;
+    virtual vec4 Vertex(int iface, int nthvert, void* /*varyings*/) override {
+        return ObjectToClipPos(*uniforms, model->vert(iface, nthvert));
     }
 
-    virtual bool Fragment(vec3 barycentric, QRgb& outColor) override {
-        vec3 normal(0, 0, 0);
-        vec4 clipPos(0, 0, 0, 0);
-        for (int i = 0; i < 3; ++i) {
-            normal = normal + barycentric[i] * vertOutput[i].viewNormal;
-            clipPos = clipPos + barycentric[i] * vertOutput[i].clipPos;
-        }
-        normal.normalize();
-        vec3 ndc = proj<3>(clipPos / clipPos.w);
-        vec2 screenPos(0.5f * ndc.x + 0.5f, 0.5f * ndc.y + 0.5f);
-        float depth = zbuffer[(int)(screenPos.y * zbufferHeight) * zbufferWidth + (int)(screenPos.x * zbufferWidth)];
-        // 手动裁剪
-        if (ndc.z < (depth - 1e-2)) {
-            return true;
+    virtual void VertexBatch(const int* corners, int n, const VertexBatchOutput& out) override {
+        if (out.clipX == nullptr) {
+            return;
         }
-
-        // 开始旋转采样
-        float totalAO = 0.f;        // 环境光被阻挡的部分
-        float rotationStep = 2 * PI / dirCount;
-        float angle = ((float)std::rand() / RAND_MAX) * rotationStep;
-        for (int i = 0; i < dirCount; ++i, angle += rotationStep) {
-            vec2 dir(std::cos(angle), std::sin(angle));
-            // 乘上rotationStep是为了计算球面积分的dθ部分 对上半部经度积分后 再对纬度积分
-            totalAO += rotationStep * CalAmbientOcclusionIntegralInOneDir(ndc, dir, normal);
+        vec3 pos[VERTEX_BATCH_SIZE];
+        for (int i = 0; i < n; ++i) {
+            pos[i] = model->vert(corners[i] / 3, corners[i] % 3);
         }
+        ObjectToClipPosBatch(*uniforms, pos, n, out.clipX, out.clipY, out.clipZ, out.clipW);
+    }
 
-        float ambient = 1.f - 1.f / (2.f * PI) * totalAO;   // 1/2pi 系数是归一化半球面积分 半球面积为1/2pi
-        outColor = (255 << 24) | ((uint8_t)(ambient * 255) << 16) | ((uint8_t)(ambient * 255) << 8) | (uint8_t)(ambient * 255);
-
+    // 只在传入了render target时才会被调用 输出黑色
+    virtual bool Fragment(const void* /*varyings*/, vec3 /*barycentric*/, QRgb& outColor) override {
+        outColor = (255 << 24);
         return false;
     }
-};
 
-class ZWriteShader : public IShader {
-    Model* model;
+    virtual int FragmentBatch(const void* /*varyings*/, const float (* /*bar*/)[FRAGMENT_BATCH_SIZE], int /*mask*/, QRgb* outColors) override {
+        for (int k = 0; k < FRAGMENT_BATCH_SIZE; ++k) {
+            outColors[k] = (255 << 24);
+        }
+        return 0;
+    }
+};
 
+/* 光源视角的深度 写入float深度缓冲 GeneralShader采样它算阴影 */
+class ShadowMapShader final : public DepthOnlyShader {
 public:
-    ZWriteShader(Model* _model) : model(_model) {}
-
-    virtual vec4 Vertex(int iface, int nthvert) override {
-        return VP_MATRIX * MODEL_MATRIX * embed<4>(model->vert(iface, nthvert));
-    }
+    ShadowMapShader(Model* _model) : DepthOnlyShader(_model) {}
+};
 
-    virtual bool Fragment(vec3 barycentric, QRgb& outColor) override {
-        outColor = (255 << 24);     // black
-        return false;
-    }
+/* 相机视角的深度prepass HBAO和主pass共用 */
+class ZWriteShader final : public DepthOnlyShader {
+public:
+    ZWriteShader(Model* _model) : DepthOnlyShader(_model) {}
 };
 
-class RayTracerShader : public IShader {
+class RayTracerShader final : public ShaderBase<RayTracerShader> {
     const int MAX_DEPTH = 5;        // 光线追踪的最深递归深度 最多计算MAX_DEPTH次反射
 
     vec3 screenMesh[2][3] = {
@@ -357,8 +415,6 @@ class RayTracerShader : public IShader {
         vec3 rayDir;
     };
 
-    v2f vertOutput[3];
-
     vec3 CastRay(const Ray& ray, int depth = 0) {
         HitResult hitResult;
 
@@ -397,9 +453,9 @@ class RayTracerShader : public IShader {
 
         // 开始计算当前光线碰撞点的颜色
         float diff = 0, spec = 0;
-        int lightNum = LIGHTS.size();
+        int lightNum = uniforms->lights.size();
         for (int i = 0; i < lightNum; ++i) {
-            const ShaderLight& light = LIGHTS[i];
+            const ShaderLight& light = uniforms->lights[i];
             vec3 lightPos = embed<3>(light.lightPos);
             vec3 lightDir = (light.lightPos.w == 0) ? lightPos : (lightPos - worldPos).normalize();
             vec3 viewDir = (-ray.dir).normalize();
@@ -425,24 +481,28 @@ public:
         halfHeight = std::tan(fov / 2.f);
     }
 
+    virtual int VaryingSize() const override {
+        return sizeof(v2f);
+    }
+
     // 只是渲染长方形画面的两个三角形 中间的像素靠光栅化插值
-    virtual vec4 Vertex(int iface, int nthvert) override {
-        v2f o;
+    virtual vec4 Vertex(int iface, int nthvert, void* varyings) override {
+        v2f& o = *static_cast<v2f*>(varyings);
         const vec3& meshP = screenMesh[iface][nthvert];
         o.rayDir = vec3(meshP.x * halfWidth, meshP.y * halfHeight, -1.f);
         // view的逆矩阵的逆转置矩阵就是view的转置->xxx 逆转置用于转换法向量的 将向量从view到world
-        o.rayDir = proj<3>(V_INVERSE_MATRIX * embed<4>(o.rayDir, 0)).normalize();
-        vertOutput[nthvert] = o;
+        o.rayDir = proj<3>(uniforms->vInverseMatrix * embed<4>(o.rayDir, 0)).normalize();
         return vec4(meshP.x, -meshP.y, meshP.z, 1.f);
     }
 
-    virtual bool Fragment(vec3 barycentric, QRgb& outColor) override {
+    virtual bool Fragment(const void* varyings, vec3 barycentric, QRgb& outColor) override {
+        const v2f* vertInput = static_cast<const v2f*>(varyings);
         vec3 rayDir = {0, 0, 0};
         for (int i = 0; i < 3; ++i) {
-            rayDir = rayDir + barycentric[i] * vertOutput[i].rayDir;
+            rayDir = rayDir + barycentric[i] * vertInput[i].rayDir;
         }
         rayDir.normalize();
-        Ray ray(CAMERA_POS, rayDir);
+        Ray ray(uniforms->cameraPos, rayDir);
 
         vec3 col = CastRay(ray);
 
@@ -453,7 +513,7 @@ public:
     }
 };
 
-class PathTracerShader : public IShader {
+class PathTracerShader final : public ShaderBase<PathTracerShader> {
     const float SAMPLE_COUNT = 100;
     const float RR_PROPABILITY = 0.8f;
 
@@ -464,16 +524,13 @@ class PathTracerShader : public IShader {
     float fov, aspect, halfWidth, halfHeight;
     World* world;
     Skybox* skybox;
-    vec2 rayHalfJitter;             // 光线在一个像素中抖动的半长度
 
     struct v2f {
         vec3 rayDir;
     };
 
-    v2f vertOutput[3];
-
     inline float rand01() {
-        return std::rand() / (float)(RAND_MAX + 1.f);
+        return ShaderRandom01();
     }
 
     inline vec3 RandVecInHemisphere(vec3 n) {
@@ -553,38 +610,37 @@ public:
         halfWidth = aspect * std::tan(fov / 2.f);
         halfHeight = std::tan(fov / 2.f);
 
-        // init jitter
-        rayHalfJitter.x = halfWidth / RT_RESOLUTION.x;
-        rayHalfJitter.y = halfHeight / RT_RESOLUTION.y;
-
-        qDebug() << '[' << rayHalfJitter.x << ',' << rayHalfJitter.y << ']';
-
         // init random seed
-        std::srand(std::time(0));
+        SeedShaderRandom(std::time(0));
+    }
+
+    virtual int VaryingSize() const override {
+        return sizeof(v2f);
     }
 
     // 只是渲染长方形画面的两个三角形 中间的像素靠光栅化插值
-    virtual vec4 Vertex(int iface, int nthvert) override {
-        v2f o;
+    virtual vec4 Vertex(int iface, int nthvert, void* varyings) override {
+        v2f& o = *static_cast<v2f*>(varyings);
         const vec3& meshP = screenMesh[iface][nthvert];
         o.rayDir = vec3(meshP.x * halfWidth, meshP.y * halfHeight, -1.f);   // 不需要normalize 因为需要对每个像素内的光线进行抖动
-        vertOutput[nthvert] = o;
         return vec4(meshP.x, -meshP.y, meshP.z, 1.f);
     }
 
-    virtual bool Fragment(vec3 barycentric, QRgb& outColor) override {
+    virtual bool Fragment(const void* varyings, vec3 barycentric, QRgb& outColor) override {
+        const v2f* vertInput = static_cast<const v2f*>(varyings);
         vec3 rayDir = {0, 0, 0};
         for (int i = 0; i < 3; ++i) {
-            rayDir = rayDir + barycentric[i] * vertOutput[i].rayDir;
+            rayDir = rayDir + barycentric[i] * vertInput[i].rayDir;
         }
 
+        vec2 rayHalfJitter(halfWidth / uniforms->rtResolution.x, halfHeight / uniforms->rtResolution.y);  // 光线在一个像素中抖动的半长度
         vec3 col(0, 0, 0);
         for (int sample = 0; sample < SAMPLE_COUNT; ++sample) {
             vec3 rayDirJitter(rayDir.x + (2.f * rand01() - 1.f) * rayHalfJitter.x,
                               rayDir.y + (2.f * rand01() - 1.f) * rayHalfJitter.y,
                               rayDir.z);
-            rayDirJitter = proj<3>(V_INVERSE_MATRIX * embed<4>(rayDirJitter, 0)).normalize();
-            Ray ray(CAMERA_POS, rayDirJitter);
+            rayDirJitter = proj<3>(uniforms->vInverseMatrix * embed<4>(rayDirJitter, 0)).normalize();
+            Ray ray(uniforms->cameraPos, rayDirJitter);
 
             HitResult hitResult;
             Object hitObj;
@@ -0,0 +1,100 @@
+#include "vertexcache.h"
+#include <algorithm>
+
+static bool SameMatrix(const mat4x4& a, const mat4x4& b) {
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            if (a[i][j] != b[i][j]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+const vec4* VertexCache::ClipPositions(const Model* model, const ShaderUniforms& uniforms) {
+    ++m_UseCounter;
+    View* lru = &m_Views[0];
+    for (int i = 0; i < MAX_VIEWS; ++i) {
+        View& view = m_Views[i];
+        if (view.model == model && SameMatrix(view.modelMatrix, uniforms.modelMatrix) && SameMatrix(view.vpMatrix, uniforms.vpMatrix)) {
+            view.lastUse = m_UseCounter;
+            return view.clipPos.data();
+        }
+        if (view.lastUse < lru->lastUse) {
+            lru = &view;
+        }
+    }
+
+    // 没有命中 替换最久没用过的视角
+    lru->model = model;
+    lru->modelMatrix = uniforms.modelMatrix;
+    lru->vpMatrix = uniforms.vpMatrix;
+    lru->lastUse = m_UseCounter;
+    int nverts = model->nverts();
+    lru->clipPos.resize(nverts);
+    int batchCount = (nverts + VERTEX_BATCH_SIZE - 1) / VERTEX_BATCH_SIZE;
+#pragma omp parallel for
+    for (int b = 0; b < batchCount; ++b) {
+        int begin = b * VERTEX_BATCH_SIZE, n = std::min(VERTEX_BATCH_SIZE, nverts - begin);
+        vec3 pos[VERTEX_BATCH_SIZE];
+        float clip[4][VERTEX_BATCH_SIZE];
+        for (int i = 0; i < n; ++i) {
+            pos[i] = model->vert(begin + i);
+        }
+        ObjectToClipPosBatch(uniforms, pos, n, clip[0], clip[1], clip[2], clip[3]);
+        for (int i = 0; i < n; ++i) {
+            lru->clipPos[begin + i] = vec4(clip[0][i], clip[1][i], clip[2][i], clip[3][i]);
+        }
+    }
+    return lru->clipPos.data();
+}
+
+void VertexCache::BeginDraw(const Model* model, IShader* shader) {
+    m_Model = model;
+    m_Shader = shader;
+    m_VaryingSize = shader->VaryingSize();
+    ++m_DrawCounter;
+    m_PendingCount = 0;
+    int nunique = model->nunique();
+    if ((int)m_ShadedDraw.size() < nunique) {
+        m_ShadedDraw.resize(nunique, 0);
+    }
+    if ((int)m_Varyings.size() < nunique * m_VaryingSize) {
+        m_Varyings.resize(nunique * m_VaryingSize);
+    }
+}
+
+const void* VertexCache::RequestVertex(int iface, int nthvert) {
+    // 没有varying的shader(z write)只需要clip坐标 不用调用顶点着色器
+    if (m_VaryingSize == 0) {
+        return nullptr;
+    }
+    int idx = m_Model->uniqueIdx(iface, nthvert);
+    char* varyings = &m_Varyings[idx * m_VaryingSize];
+    if (m_ShadedDraw[idx] != m_DrawCounter) {
+        m_PendingCorners[m_PendingCount] = iface * 3 + nthvert;
+        m_PendingVaryings[m_PendingCount] = varyings;
+        ++m_PendingCount;
+        m_ShadedDraw[idx] = m_DrawCounter;
+    }
+    return varyings;
+}
+
+void VertexCache::FlushVertices() {
+    if (m_PendingCount == 0) {
+        return;
+    }
+    // clip坐标已经在ClipPositions中算好了
+    VertexBatchOutput out;
+    out.varyings = m_PendingVaryings;
+    m_Shader->VertexBatch(m_PendingCorners, m_PendingCount, out);
+    m_PendingCount = 0;
+}
+
+void VertexCache::Invalidate() {
+    for (int i = 0; i < MAX_VIEWS; ++i) {
+        m_Views[i].model = nullptr;
+        m_Views[i].lastUse = 0;
+    }
+}
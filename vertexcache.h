@@ -0,0 +1,53 @@
+#ifndef VERTEXCACHE_H
+#define VERTEXCACHE_H
+
+#include <vector>
+#include "geometry.h"
+#include "model.h"
+#include "shader.h"
+
+/* 变换后的顶点缓存
+ * 1. clip坐标: 按model的顶点位置序号保存 以(model, modelMatrix, vpMatrix)为key
+ *    相机相同的几个pass(z write, 主pass)共用同一份 只在第一次用到时变换
+ *    光栅化器先用它做视锥和背面剔除 被剔除的三角形不会调用顶点着色器
+ * 2. 顶点着色结果: 每次draw按唯一顶点(v/vt/vn都相同)保存v2f 同一个顶点被多个三角形共用时只着色一次
+ *    用到的顶点先排队 攒够一批后一起交给shader->VertexBatch
+ * 顶点着色器返回的clip坐标必须和ObjectToClipPos一致 光栅化时用的是缓存里的clip坐标
+ */
+class VertexCache {
+public:
+    static const int MAX_VIEWS = 4;         // 同时缓存的视角数 相机和光源各占一个
+
+private:
+    struct View {
+        const Model* model = nullptr;
+        mat4x4 modelMatrix;
+        mat4x4 vpMatrix;
+        std::vector<vec4> clipPos;
+        int lastUse = 0;
+    };
+
+    View m_Views[MAX_VIEWS];
+    int m_UseCounter = 0;
+
+    // 当前draw的顶点着色结果
+    const Model* m_Model = nullptr;
+    IShader* m_Shader = nullptr;
+    int m_VaryingSize = 0;
+    std::vector<char> m_Varyings;           // 每个唯一顶点一个v2f
+    std::vector<int> m_ShadedDraw;          // 唯一顶点最后一次着色时的draw序号 不等于m_DrawCounter说明本次draw还没着色
+    int m_DrawCounter = 0;
+    int m_PendingCorners[VERTEX_BATCH_SIZE];    // 排队等待着色的顶点 iface * 3 + nthvert
+    void* m_PendingVaryings[VERTEX_BATCH_SIZE]; // 着色结果写到哪里
+    int m_PendingCount = 0;
+
+public:
+    const vec4* ClipPositions(const Model* model, const ShaderUniforms& uniforms);     // uniforms的矩阵下model所有顶点的clip坐标 按vertIdx索引
+    void BeginDraw(const Model* model, IShader* shader);
+    const void* RequestVertex(int iface, int nthvert);      // 返回该顶点v2f的位置 本次draw第一次用到时排队 FlushVertices之后才能读
+    bool Full() const { return m_PendingCount + 3 > VERTEX_BATCH_SIZE; }    // 放不下下一个三角形的顶点了
+    void FlushVertices();                                   // 对排队的顶点调用shader->VertexBatch
+    void Invalidate();                                      // model顶点被修改后需要调用
+};
+
+#endif // VERTEXCACHE_H
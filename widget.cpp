@@ -1,5 +1,6 @@
 #include "widget.h"
 #include "skybox.h"
+#include <cstring>
 
 // #define CLEAR_RT
 // #define SOFT_RASTER
@@ -25,17 +26,10 @@ SoftRaster::SoftRaster(QWidget *parent) : QWidget(parent) {
     m_AnotherMonitor->show();
 
     // init pixel buffer
-    m_PixelBuffer = new QRgb[m_WindowWidth * m_WindowHeight];
+    m_PixelBuffer = new ColorBuffer(m_WindowWidth, m_WindowHeight);
 
-    // init zbuffer
-    m_Zbuffer = new float[m_WindowWidth * m_WindowHeight];
-    m_Zbuffer1 = new float[m_WindowWidth * m_WindowHeight];
-
-    // init shadow map
-    m_ShadowMap = new QRgb[m_WindowWidth * m_WindowHeight];
-
-    // init AO map
-    m_AOMap = new QRgb[m_WindowWidth * m_WindowHeight];
+    // init render graph 其余buffer和每个worker的光栅化器在这里分配
+    BuildRenderGraph();
 
     // set shader env
     // 设置模型TRS
@@ -43,7 +37,6 @@ SoftRaster::SoftRaster(QWidget *parent) : QWidget(parent) {
     vec3 rotation(0, 0, 0);
     vec3 scale(1.2, 1.2, 1.2);
     mat4x4 model = TRS(translate, rotation, scale);
-    SetModelMatrix(model);
 
     // 设置相机参数
     vec3 worldUp(0, 1, 0);
@@ -56,24 +49,26 @@ SoftRaster::SoftRaster(QWidget *parent) : QWidget(parent) {
     vec3 lightPos(1, 1, 1);
     vec3 lightDir = vec3(0, 0, 0) - lightPos;
     m_PointLight = new Light(lightColor, lightPos, lightDir, ProjectionType::PERSP);
-    SetCameraAndLight(cameraPos, embed<4>(lightPos));
-    SetViewMatrix(m_PointLight->GetViewMatrix());       // 利用set函数 将raw view和proj矩阵转变成最后使用的VP_MATRIX
-    SetProjectionMatrix(m_PointLight->GetProjectionMatrix());
-    m_PointLight->SetWorld2Light(VP_MATRIX);
+    m_CameraUniforms.cameraPos = cameraPos;
+    m_CameraUniforms.light0 = embed<4>(lightPos);
 
     // 设置光源数组
     ShaderLight lights[2];
     lights[0] = {{-0.5f, 0.5f, 0.5f, 1.f}, {0.8, 1, 1}, 0.7f};
     lights[1] = {{0.5f, 0.5f, 0.5f, 1.f}, {1, 0.8, 1}, 0.7f};
-    SetLightArray(lights, 2);
+    m_CameraUniforms.lights.assign(lights, lights + 2);
 
     // 设置render target分辨率
-    SetRenderTargetResolution(m_WindowWidth, m_WindowHeight);
+    m_CameraUniforms.rtResolution = vec2(m_WindowWidth, m_WindowHeight);
 
-    // 初始化模型加速结构
+    // 相机和光源视角各一份uniform 光照参数相同 变换不同
+    m_LightUniforms = m_CameraUniforms;
+    m_CameraUniforms.SetTransforms(model, m_Camera->GetViewMatrix(), m_Camera->GetProjectionMatrix());
+    m_LightUniforms.SetTransforms(model, m_PointLight->GetViewMatrix(), m_PointLight->GetProjectionMatrix());
+    m_PointLight->SetWorld2Light(m_LightUniforms.vpMatrix);
+
+    // 模型加速结构 和下面world中各个网格的加速结构一起并行构建
     m_ModelAccel = new Accel(&africanHeadModel);
-    m_ModelAccel->Build();
-    qDebug() << "face number: " << africanHeadModel.nfaces();
 
     // 加载model数组 初始化obj和world
     worldMaterial.push_back(new OpaqueBRDF(vec3(0.4f, 0.5f, 0.6f), 0.8f, 0.0f));
@@ -83,9 +78,11 @@ SoftRaster::SoftRaster(QWidget *parent) : QWidget(parent) {
     worldMaterial.push_back(new OpaqueBRDF(vec3(0.7f, 0.7f, 0.7f), 0.0f, 0.0f));
     worldMesh = Model::ModelReader("./obj/cornell_box/cornell_box.obj");
     int size = worldMesh.size();
+    Accel::BuildConfig worldConfig;
+    worldConfig.watertight = true;      // cornell box的墙和方块都是两个三角形拼成的面 路径追踪时光线不能从对角线的接缝漏出去
     for (int i = 0; i < size; ++i) {
         Accel* accel = new Accel(worldMesh[i]);
-        accel->Build();
+        accel->SetBuildConfig(worldConfig);
         worldAccel.push_back(accel);
 
         // 使用mesh生成obj
@@ -110,6 +107,12 @@ SoftRaster::SoftRaster(QWidget *parent) : QWidget(parent) {
             world.AddObjects(obj);
         }
     }
+    std::vector<Accel*> accels = worldAccel;
+    accels.push_back(m_ModelAccel);
+    Accel::Build(accels);
+    qDebug() << "face number: " << africanHeadModel.nfaces();
+    qDebug() << "BVH build time: " << m_ModelAccel->GetBuildTime() << "ms\tSAH cost: " << m_ModelAccel->GetSAHCost()
+             << "\tnode num: " << m_ModelAccel->GetNodeNum();
     world.Build();
 
     // 加载资源与生成shader
@@ -123,15 +126,20 @@ SoftRaster::SoftRaster(QWidget *parent) : QWidget(parent) {
     specImg->read_tga_file("./obj/diablo3_pose/diablo3_pose_spec.tga");
     specImg->flip_vertically();
     Skybox* skybox = new Skybox("./resources/skybox/skybox");
+#ifdef SOFT_RASTER
+    // shadow map和prepass深度只在光栅化的graph中存在 AO map由主pass每帧从graph取出来设置
     m_Shader = new GeneralShader(
                 &africanHeadModel, diffuseImg, normalImg, specImg,
-                new QImage((uchar*)m_ShadowMap, m_WindowWidth, m_WindowHeight, QImage::Format_ARGB32),
-                m_PointLight->GetWorld2Light(),
-                new QImage((uchar*)m_AOMap, m_WindowWidth, m_WindowHeight, QImage::Format_ARGB32)
+                m_ShadowMap->Data(), m_ShadowMap->Width(), m_ShadowMap->Height()
                 );
     m_ShadowMapShader = new ShadowMapShader(&africanHeadModel);
-    m_HBAOShader = new HBAOShader(&africanHeadModel, m_Zbuffer1, m_WindowWidth, m_WindowHeight);
+    m_HBAOPass = new HBAOPass(m_WindowWidth, m_WindowHeight);
+    m_MSAAResolvePass = new MSAAResolvePass();
+    m_BloomPass = new BloomPass(m_WindowWidth, m_WindowHeight);
+    m_ToneMapPass = new ToneMapPass();
+    m_FXAAPass = new FXAAPass(m_WindowWidth, m_WindowHeight);
     m_ZWriteShader = new ZWriteShader(&africanHeadModel);
+#endif
     m_RayTracerShader = new RayTracerShader(&africanHeadModel, m_ModelAccel, skybox);
     m_PathTracerShader = new PathTracerShader(&world, skybox);
 
@@ -143,14 +151,20 @@ SoftRaster::SoftRaster(QWidget *parent) : QWidget(parent) {
 SoftRaster::~SoftRaster() {
     killTimer(m_RepaintTimer);
     delete m_AnotherMonitor;
-    delete[] m_PixelBuffer;
-    delete[] m_Zbuffer;
-    delete[] m_Zbuffer1;
-    delete[] m_ShadowMap;
-    delete[] m_AOMap;
+    delete m_PixelBuffer;
+    delete m_ShadowMap;
+    delete m_RenderGraph;
+    for (size_t i = 0; i < m_Rasterizers.size(); ++i) {
+        delete m_Rasterizers[i];
+        delete m_VertexCaches[i];
+    }
     delete m_Shader;
     delete m_ShadowMapShader;
-    delete m_HBAOShader;
+    delete m_HBAOPass;
+    delete m_MSAAResolvePass;
+    delete m_BloomPass;
+    delete m_ToneMapPass;
+    delete m_FXAAPass;
     delete m_ZWriteShader;
     delete m_RayTracerShader;
     delete m_PathTracerShader;
@@ -170,150 +184,250 @@ SoftRaster::~SoftRaster() {
 }
 
 
-void SoftRaster::paintEvent(QPaintEvent*) {
-    QPainter painter(this);
-    QImage image((uchar*)m_PixelBuffer, m_WindowWidth, m_WindowHeight, QImage::Format_ARGB32);
-
-    // timer start
-    LARGE_INTEGER cpuFreq;
-    LARGE_INTEGER startTime;
-    LARGE_INTEGER endTime;
-    double runtime = 0.0;
-    QueryPerformanceFrequency(&cpuFreq);
-    QueryPerformanceCounter(&startTime);
-
-#ifdef CLEAR_RT
-    // clear image with black and clear depth buffer
-    QRgb bgColor = 255 << 24;
-#pragma omp parallel for
-    for (int i = 0; i < m_WindowHeight; ++i) {
-        for (int j = 0; j < m_WindowWidth; ++j) {
-            m_PixelBuffer[i * m_WindowWidth + j] = bgColor;
-            m_Zbuffer[i * m_WindowWidth + j] = Z_MIN;
-            m_Zbuffer1[i * m_WindowWidth + j] = Z_MIN;
-            m_ShadowMap[i * m_WindowWidth + j] = bgColor;
-            m_AOMap[i * m_WindowWidth + j] = bgColor;
-        }
-    }
+void SoftRaster::BuildRenderGraph() {
+    m_RenderGraph = new RenderGraph(m_WindowWidth, m_WindowHeight, Z_MIN);
+    RenderGraph* graph = m_RenderGraph;
+#if defined(SOFT_RASTER) || defined(RAY_TRACER) || defined(PATH_TRACER)
+    RenderGraph::Handle pixelBuffer = graph->ImportColor("pixel buffer", m_PixelBuffer);
 #endif
 
 ///////////////////////////////////////// SOFT RASTER START ////////////////////////////
 #ifdef SOFT_RASTER
-    /// HBAO rendering
-    // Pass 0: z write
-    {
-        SetViewMatrix(m_Camera->GetViewMatrix());
-        SetProjectionMatrix(m_Camera->GetProjectionMatrix());
-        int faceCount = africanHeadModel.nfaces();
-        for (int i = 0; i < faceCount; ++i) {
-            vec4 clipPts[3];
-            for (int j = 0; j < 3; ++j) {
-                clipPts[j] = m_ZWriteShader->Vertex(i, j);
-            }
-            // 将深度写入m_Zbuffer1
-            Triangle(clipPts, m_ZWriteShader, m_PixelBuffer, m_Zbuffer1);
-        }
-    }
+    // 相机视角的深度和主pass的颜色是多重采样的 主pass之后resolve成单采样再做后处理
+    bool msaa = m_MSAASamples > 1;
+    RenderGraph::Handle prepassDepth = graph->CreateDepth("prepass depth", m_MSAASamples);
+    RenderGraph::Handle AOMap = graph->CreateColor("AO map");
+    RenderGraph::Handle HDRColor = graph->CreateColor("HDR color", ColorBuffer::FORMAT_RGBA32F);     // 主pass输出的线性颜色
+    RenderGraph::Handle mainColor = msaa ? graph->CreateColor("HDR color MSAA", ColorBuffer::FORMAT_RGBA32F, m_MSAASamples) : HDRColor;
+    RenderGraph::Handle LDRColor = graph->CreateColor("LDR color");
+    m_ShadowMap = new DepthBuffer(m_WindowWidth, m_WindowHeight);
+    RenderGraph::Handle shadowDepth = graph->ImportDepth("shadow depth", m_ShadowMap);
+
+    // 共用Pass 0深度的pass 只有与prepass深度相等的像素才会着色
+    Rasterizer::RenderState prepassState;
+    prepassState.depthTest = Rasterizer::DEPTH_EQUAL;
+    prepassState.depthWrite = false;
+    bool sharePrepass = m_ShareDepthPrepass;
 
-    // Pass 1: draw HBAO
-    {
-        int faceCount = africanHeadModel.nfaces();
-        for (int i = 0; i < faceCount; ++i) {
-            vec4 clipPts[3];
-            for (int j = 0; j < 3; ++j) {
-                clipPts[j] = m_HBAOShader->Vertex(i, j);
-            }
-            // 将深度写入m_Zbuffer1
-            Triangle(clipPts, m_HBAOShader, m_AOMap, m_Zbuffer);
-        }
-    }
+    /// HBAO rendering
+    // Pass 0: z write 只写深度
+    graph->AddPass("z prepass",
+        [=](RenderGraph::PassBuilder& builder) {
+            builder.Write(prepassDepth);
+        },
+        [=](int worker) {
+            DrawIndexed(worker, &africanHeadModel, m_ZWriteShader, m_CameraUniforms, nullptr, graph->Depth(prepassDepth));
+        });
+
+    // Pass 1: HBAO 屏幕空间后处理 只采样prepass的深度 不再光栅化模型 多重采样时取每个像素的第一个采样点
+    graph->AddPass("HBAO",
+        [=](RenderGraph::PassBuilder& builder) {
+            builder.Read(prepassDepth);
+            builder.Write(AOMap);
+        },
+        [=](int /*worker*/) {
+            m_HBAOPass->Execute(graph->Depth(prepassDepth), m_CameraUniforms, graph->Color(AOMap));
+        });
 
     /// shadow rendering
-    // Pass 2: draw shadow map
-    {
-#pragma omp parallel for
-        for (int i = 0; i < m_WindowHeight; ++i) {
-            for (int j = 0; j < m_WindowWidth; ++j) {
-                m_Zbuffer[i * m_WindowWidth + j] = Z_MIN;
-            }
-        }
-        SetViewMatrix(m_PointLight->GetViewMatrix());
-        SetProjectionMatrix(m_PointLight->GetProjectionMatrix());
-        int faceCount = africanHeadModel.nfaces();
-        for (int i = 0; i < faceCount; ++i) {
-            vec4 clipPts[3];
-            for (int j = 0; j < 3; ++j) {
-                clipPts[j] = m_ShadowMapShader->Vertex(i, j);
+    // Pass 2: draw shadow map 不依赖前两个pass 和它们并行 只写float深度 主pass直接采样深度缓冲
+    // 光源和模型都没动时沿用上一帧的shadow map
+    graph->AddPass("shadow map",
+        [=](RenderGraph::PassBuilder& builder) {
+            builder.Write(shadowDepth);
+        },
+        [=](int worker) {
+            if (!ShadowMapDirty()) {
+                return;
             }
-            Triangle(clipPts, m_ShadowMapShader, m_ShadowMap, m_Zbuffer);
-        }
-    }
+            m_ShadowMap->Clear(Z_MIN);
+            DrawIndexed(worker, &africanHeadModel, m_ShadowMapShader, m_LightUniforms, nullptr, m_ShadowMap);
+            m_ShadowMapLightVP = m_LightUniforms.vpMatrix;
+            m_ShadowMapModel = m_LightUniforms.modelMatrix;
+            m_ShadowMapValid = true;
+        });
 
     /// blin phong rendering
     // Pass 3: draw model
-    {
-#pragma omp parallel for
-        for (int i = 0; i < m_WindowHeight; ++i) {
-            for (int j = 0; j < m_WindowWidth; ++j) {
-                m_Zbuffer[i * m_WindowWidth + j] = Z_MIN;
-                m_PixelBuffer[i * m_WindowWidth + j] = bgColor;
+    // 法线贴图 阴影和AO的采样只对最终可见的像素做一次 没有prepass时用visibility buffer
+    // 多重采样时光栅化器不支持visibility buffer 不共用prepass的话退回forward
+    RenderGraph::Handle mainDepth = sharePrepass ? prepassDepth : graph->CreateDepth("main depth", m_MSAASamples);
+    graph->AddPass("main",
+        [=](RenderGraph::PassBuilder& builder) {
+            builder.Read(shadowDepth);
+            builder.Read(AOMap);
+            if (sharePrepass) {
+                builder.Read(prepassDepth);
             }
-        }
-        SetViewMatrix(m_Camera->GetViewMatrix());
-        SetProjectionMatrix(m_Camera->GetProjectionMatrix());
-        int faceCount = africanHeadModel.nfaces();
-        for (int i = 0; i < faceCount; ++i) {
-            vec4 clipPts[3];
-            for (int j = 0; j < 3; ++j) {
-                clipPts[j] = m_Shader->Vertex(i, j);
+            else {
+                builder.Write(mainDepth);
             }
-            m_Shader->Geometry();
-            Triangle(clipPts, m_Shader, m_PixelBuffer, m_Zbuffer);
-        }
+            builder.Write(mainColor);
+        },
+        [=](int worker) {
+            Rasterizer::RenderState deferredState;
+            deferredState.deferred = true;
+            m_Shader->SetAOMap(graph->Color(AOMap));
+            DrawIndexed(worker, &africanHeadModel, m_Shader, m_CameraUniforms, graph->Color(mainColor), graph->Depth(mainDepth),
+                        sharePrepass ? prepassState : deferredState);
+        });
+
+    // MSAA resolve 多个采样点的颜色合成一个像素
+    if (msaa) {
+        graph->AddPass("MSAA resolve",
+            [=](RenderGraph::PassBuilder& builder) {
+                builder.Read(mainColor);
+                builder.Write(HDRColor);
+            },
+            [=](int /*worker*/) {
+                m_MSAAResolvePass->Execute(graph->Color(mainColor), graph->Color(HDRColor));
+            });
     }
+
+    /// post processing
+    // Pass 4: bloom 采样并叠加回浮点颜色
+    graph->AddPass("bloom",
+        [=](RenderGraph::PassBuilder& builder) {
+            builder.Read(HDRColor);
+            builder.Write(HDRColor);
+        },
+        [=](int /*worker*/) {
+            m_BloomPass->Execute(graph->Color(HDRColor));
+        });
+
+    // Pass 5: tone mapping和sRGB编码 转成8bit
+    graph->AddPass("tone mapping",
+        [=](RenderGraph::PassBuilder& builder) {
+            builder.Read(HDRColor);
+            builder.Write(LDRColor);
+        },
+        [=](int /*worker*/) {
+            m_ToneMapPass->Execute(graph->Color(HDRColor), graph->Color(LDRColor));
+        });
+
+    // Pass 6: FXAA 写到最终显示的color buffer
+    graph->AddPass("FXAA",
+        [=](RenderGraph::PassBuilder& builder) {
+            builder.Read(LDRColor);
+            builder.Write(pixelBuffer);
+        },
+        [=](int /*worker*/) {
+            m_FXAAPass->Execute(graph->Color(LDRColor), m_PixelBuffer);
+        });
 #endif
 ///////////////////////////////// SOFT RASTER END /////////////////////////////
 
+    // 光栅化的步骤是为了插值ray 实际只有两个三角面片构成的长方形mesh
+    Rasterizer::RenderState quadState;
+    quadState.cullMode = Rasterizer::CULL_NONE;
+
 ///////////////////////////////// RAY TRACER START ////////////////////////////
 #ifdef RAY_TRACER
-    SetViewMatrix(m_Camera->GetViewMatrix());
-    SetProjectionMatrix(m_Camera->GetProjectionMatrix());
-    // 光栅化的步骤是为了插值ray 实际只有两个三角面片构成的长方形mesh
-    for (int i = 0; i < 2; ++i) {
-        vec4 clipPts[3];
-        for (int j = 0; j < 3; ++j) {
-            clipPts[j] = m_RayTracerShader->Vertex(i, j);
-        }
-        Triangle(clipPts, m_RayTracerShader, m_PixelBuffer, m_Zbuffer);
-    }
+    RenderGraph::Handle rayTracerDepth = graph->CreateDepth("ray tracer depth");
+    graph->AddPass("ray tracer",
+        [=](RenderGraph::PassBuilder& builder) {
+            builder.Write(rayTracerDepth);
+            builder.Write(pixelBuffer);
+        },
+        [=](int worker) {
+            Draw(worker, 2, m_RayTracerShader, m_CameraUniforms, m_PixelBuffer, graph->Depth(rayTracerDepth), quadState);
+        });
 #endif
 ///////////////////////////////// RAY TRACER END ////////////////////////////
 
 ///////////////////////////////// PATH TRACER START ////////////////////////////
 #ifdef PATH_TRACER
-    SetViewMatrix(m_Camera->GetViewMatrix());
-    SetProjectionMatrix(m_Camera->GetProjectionMatrix());
-    SetRenderTargetResolution(m_WindowWidth, m_WindowHeight);
-    // 光栅化的步骤是为了插值ray 实际只有两个三角面片构成的长方形mesh
-    for (int i = 0; i < 2; ++i) {
-        vec4 clipPts[3];
-        for (int j = 0; j < 3; ++j) {
-            clipPts[j] = m_PathTracerShader->Vertex(i, j);
+    RenderGraph::Handle pathTracerDepth = graph->CreateDepth("path tracer depth");
+    graph->AddPass("path tracer",
+        [=](RenderGraph::PassBuilder& builder) {
+            builder.Write(pathTracerDepth);
+            builder.Write(pixelBuffer);
+        },
+        [=](int worker) {
+            Draw(worker, 2, m_PathTracerShader, m_CameraUniforms, m_PixelBuffer, graph->Depth(pathTracerDepth), quadState);
+        });
+#endif
+///////////////////////////////// PATH TRACER END ////////////////////////////
+
+    graph->Compile();
+    qDebug() << "render graph: " << graph->WaveCount() << " waves, transient buffers "
+             << graph->TransientBytes() / 1024 << "KB";
+
+#ifdef SOFT_RASTER
+    m_AOMap = graph->Color(AOMap);
+    m_Zbuffer1 = graph->Depth(prepassDepth);
+#endif
+    int workerCount = graph->WorkerCount();
+    for (int i = 0; i < workerCount; ++i) {
+        m_Rasterizers.push_back(new Rasterizer(m_WindowWidth, m_WindowHeight));
+        m_VertexCaches.push_back(new VertexCache());
+    }
+}
+
+Rasterizer::Stats SoftRaster::GetStats() const {
+    Rasterizer::Stats stats;
+    for (size_t i = 0; i < m_Rasterizers.size(); ++i) {
+        stats += m_Rasterizers[i]->GetStats();
+    }
+    return stats;
+}
+
+
+bool SoftRaster::ShadowMapDirty() const {
+    if (!m_ShadowMapValid) {
+        return true;
+    }
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            if (m_ShadowMapLightVP[i][j] != m_LightUniforms.vpMatrix[i][j] ||
+                m_ShadowMapModel[i][j] != m_LightUniforms.modelMatrix[i][j]) {
+                return true;
+            }
         }
-        Triangle(clipPts, m_PathTracerShader, m_PixelBuffer, m_Zbuffer);
     }
+    return false;
+}
+
+
+void SoftRaster::paintEvent(QPaintEvent*) {
+    QPainter painter(this);
+    QImage image((uchar*)m_PixelBuffer->Data(), m_WindowWidth, m_WindowHeight, QImage::Format_ARGB32);
+
+    // timer start
+    LARGE_INTEGER cpuFreq;
+    LARGE_INTEGER startTime;
+    LARGE_INTEGER endTime;
+    double runtime = 0.0;
+    QueryPerformanceFrequency(&cpuFreq);
+    QueryPerformanceCounter(&startTime);
+    for (size_t i = 0; i < m_Rasterizers.size(); ++i) {
+        m_Rasterizers[i]->ResetStats();
+    }
+
+#ifdef CLEAR_RT
+    // clear image with black 其余buffer由render graph在第一次使用前清空
+    m_PixelBuffer->Clear(255 << 24);
 #endif
-///////////////////////////////// PATH TRACER END ////////////////////////////
+
+    // 主pass按光源视角uniform的vp矩阵采样shadow map 和shadow map pass画图(或判断能否沿用上一帧)用的是同一个矩阵
+    // 光源移动后改m_LightUniforms即可 两边一起更新
+    m_CameraUniforms.lightVPMatrix = m_LightUniforms.vpMatrix;
+    m_RenderGraph->Execute();
+    m_PixelBuffer->Resolve();       // 没画到的tile填成背景色
 
     // timer end
     QueryPerformanceCounter(&endTime);
     runtime = (((endTime.QuadPart - startTime.QuadPart) * 1000.0f) / cpuFreq.QuadPart);
     qDebug() << "runtime: " << runtime << "ms";
+    Rasterizer::Stats stats = GetStats();
+    qDebug() << "triangles: " << stats.submitted << " frustum culled: " << stats.frustumCulled
+             << " backface culled: " << stats.backfaceCulled << " degenerate culled: " << stats.degenerateCulled
+             << " occluded: " << stats.occludedCulled;
 
 
     // draw image on window
     painter.drawImage(0, 0, image);
-    // m_AnotherMonitor->Draw(m_ShadowMap, m_WindowWidth, m_WindowHeight);
+    // m_AnotherMonitor->Draw(m_AOMap->Data(), m_WindowWidth, m_WindowHeight);
 }
 
 
@@ -342,13 +456,15 @@ void SoftRaster::Line(int x1, int y1, int x2, int y2, QRgb color) {
     }
 
     int stepY = (y2 < y1) ? -1 : 1;     // 确定y是向上还是向下长一个像素格
+    m_PixelBuffer->Resolve();           // 直接写像素 不经过tile的清空标记
+    QRgb* pixels = m_PixelBuffer->Data();
 
     if (steep) {
         int m = 2 * std::abs(y2 - y1);
         int dx = x2 - x1;
         int error = 0;
         for (int x = x1, y = y1; x <= x2; ++x) {
-            m_PixelBuffer[y + x * m_WindowWidth] = color;   // steep=true xy需要交换一下
+            pixels[y + x * m_WindowWidth] = color;   // steep=true xy需要交换一下
             error += m;
             if (error > dx) {
                 y += stepY;
@@ -361,7 +477,7 @@ void SoftRaster::Line(int x1, int y1, int x2, int y2, QRgb color) {
         int dx = x2 - x1;
         int error = 0;
         for (int x = x1, y = y1; x <= x2; ++x) {
-            m_PixelBuffer[x + y * m_WindowWidth] = color;
+            pixels[x + y * m_WindowWidth] = color;
             error += m;
             if (error > dx) {
                 y += stepY;
@@ -372,67 +488,96 @@ void SoftRaster::Line(int x1, int y1, int x2, int y2, QRgb color) {
 }
 
 
-void SoftRaster::Triangle(vec4 *clipPts, IShader* shader, QRgb* renderTarget, float* zbuffer) {
-    vec2 screenPts[3] = {
-        vec2((0.5f * (clipPts[0].x / clipPts[0].w) + 0.5f) * m_WindowWidth, (0.5f * (clipPts[0].y / clipPts[0].w) + 0.5f) * m_WindowHeight),
-        vec2((0.5f * (clipPts[1].x / clipPts[1].w) + 0.5f) * m_WindowWidth, (0.5f * (clipPts[1].y / clipPts[1].w) + 0.5f) * m_WindowHeight),
-        vec2((0.5f * (clipPts[2].x / clipPts[2].w) + 0.5f) * m_WindowWidth, (0.5f * (clipPts[2].y / clipPts[2].w) + 0.5f) * m_WindowHeight)
-    };
-
-    vec2 boundBoxMin = vec2(m_WindowWidth - 1, m_WindowHeight - 1);
-    vec2 boundBoxMax = vec2(0, 0);
-
-    for (int i = 0; i < 3; ++i) {
-        boundBoxMin.x = std::max(0.f, std::min(screenPts[i].x, boundBoxMin.x));
-        boundBoxMin.y = std::max(0.f, std::min(screenPts[i].y, boundBoxMin.y));
-
-        boundBoxMax.x = std::min(m_WindowWidth - 1.f, std::max(screenPts[i].x, boundBoxMax.x));
-        boundBoxMax.y = std::min(m_WindowHeight - 1.f, std::max(screenPts[i].y, boundBoxMax.y));
+template<class ShaderT>
+void SoftRaster::Draw(int worker, int faceCount, ShaderT* shader, const ShaderUniforms& uniforms, ColorBuffer* renderTarget, DepthBuffer* zbuffer, const Rasterizer::RenderState& state) {
+    Rasterizer* rasterizer = m_Rasterizers[worker];
+    shader->SetUniforms(&uniforms);
+    rasterizer->Begin(shader, renderTarget, zbuffer, state);
+    // 当前三角形三个顶点的v2f 连续存放 光栅化器提交时会拷走
+    int varyingSize = shader->VaryingSize();
+    std::vector<char> vertOutput(3 * varyingSize);
+    for (int i = 0; i < faceCount; ++i) {
+        vec4 clipPts[3];
+        const void* vertVaryings[3];
+        for (int j = 0; j < 3; ++j) {
+            void* o = varyingSize > 0 ? &vertOutput[j * varyingSize] : nullptr;
+            clipPts[j] = shader->Vertex(i, j, o);
+            vertVaryings[j] = o;
+        }
+        if (rasterizer->Cull(clipPts)) {
+            continue;
+        }
+        shader->Geometry(vertOutput.data());
+        rasterizer->Submit(clipPts, vertVaryings);
     }
+    rasterizer->Flush();
+}
 
-#pragma omp parallel for
-    for (int y = (int)boundBoxMin.y; y <= (int)boundBoxMax.y; ++y) {
-        for (int x = (int)boundBoxMin.x; x <= (int)boundBoxMax.x; ++x) {
-            vec3 screenBar = Barycentric(screenPts, vec2(x, y));    // 屏幕空间重心坐标
-            if (screenBar.x < 0.f || screenBar.y < 0.f || screenBar.z < 0.f) {
-                continue;
-            }
-            // 计算实际空间的重心坐标 透视矫正 1/zt = a*1/z1 + b*1/z2 + c*1/z3  It/zt = a*I1/z1 + b*I2/z2 + c*I3/z3 然后view->proj后w分量是z值
-            vec3 clipBar = vec3(screenBar.x / clipPts[0].w, screenBar.y / clipPts[1].w, screenBar.z / clipPts[2].w);
-            clipBar = clipBar / (clipBar.x + clipBar.y + clipBar.z);
-            float depth = (clipBar.x * clipPts[0].z + clipBar.y * clipPts[1].z + clipBar.z * clipPts[2].z) / (clipBar.x * clipPts[0].w + clipBar.y * clipPts[1].w + clipBar.z * clipPts[2].w);
-            // 深度测试 z从里到外增大 [far, near]->[0, 1]
-            if (depth < zbuffer[x + y * m_WindowWidth]) {
-                continue;
-            }
-            QRgb color;
-            bool discard = shader->Fragment(clipBar, color);
-            if (!discard) {
-                renderTarget[x + y * m_WindowWidth] = color;
-                zbuffer[x + y * m_WindowWidth] = depth;
-            }
+template<class ShaderT>
+void SoftRaster::DrawIndexed(int worker, const Model* model, ShaderT* shader, const ShaderUniforms& uniforms, ColorBuffer* renderTarget, DepthBuffer* zbuffer, const Rasterizer::RenderState& state) {
+    Rasterizer* rasterizer = m_Rasterizers[worker];
+    VertexCache* vertexCache = m_VertexCaches[worker];
+    shader->SetUniforms(&uniforms);
+    const vec4* clipPos = vertexCache->ClipPositions(model, uniforms);
+    vertexCache->BeginDraw(model, shader);
+    rasterizer->Begin(shader, renderTarget, zbuffer, state);
+
+    // 剔除后留下的三角形先攒着 它们用到的顶点凑够一批一起着色后再提交
+    int faces[VERTEX_BATCH_SIZE];
+    const void* faceVaryings[VERTEX_BATCH_SIZE][3];
+    int batchCount = 0;
+    int faceCount = model->nfaces();
+    for (int i = 0; i < faceCount; ++i) {
+        vec4 clipPts[3];
+        for (int j = 0; j < 3; ++j) {
+            clipPts[j] = clipPos[model->vertIdx(i, j)];
         }
+        // 先剔除 被丢掉的三角形不做顶点着色
+        if (rasterizer->Cull(clipPts)) {
+            continue;
+        }
+        if (batchCount == VERTEX_BATCH_SIZE || vertexCache->Full()) {
+            vertexCache->FlushVertices();
+            SubmitFaces(rasterizer, model, shader, clipPos, faces, faceVaryings, batchCount);
+            batchCount = 0;
+        }
+        faces[batchCount] = i;
+        for (int j = 0; j < 3; ++j) {
+            faceVaryings[batchCount][j] = vertexCache->RequestVertex(i, j);
+        }
+        ++batchCount;
     }
+    vertexCache->FlushVertices();
+    SubmitFaces(rasterizer, model, shader, clipPos, faces, faceVaryings, batchCount);
+    rasterizer->Flush();
 }
 
-
-// 解重心坐标 u*AB + v*AC + PA = 0
-vec3 SoftRaster::Barycentric(vec2 *pts, vec2 p) {
-    vec3 ret = cross(
-        vec3(pts[1].x - pts[0].x, pts[2].x - pts[0].x, pts[0].x - p.x),
-        vec3(pts[1].y - pts[0].y, pts[2].y - pts[0].y, pts[0].y - p.y)
-    );
-
-    // 整数坐标输入 cross后应该也是整数 abs(ret.z)<1意味着ret[2]是0 即输入三角形退化成线段或点
-    if (std::abs(ret.z) < 1.f) {
-        return vec3(-1.f, 1.f, 1.f);
+template<class ShaderT>
+void SoftRaster::SubmitFaces(Rasterizer* rasterizer, const Model* model, ShaderT* shader, const vec4* clipPos, const int* faces, const void* const (*varyings)[3], int n) {
+    int varyingSize = shader->VaryingSize();
+    // 几何着色器按三角形修改顶点 缓存里的顶点被多个三角形共用 要先拷出来再修改
+    std::vector<char> geometryVaryings(shader->HasGeometry() ? 3 * varyingSize : 0);
+    for (int i = 0; i < n; ++i) {
+        vec4 clipPts[3];
+        const void* vertVaryings[3];
+        for (int j = 0; j < 3; ++j) {
+            clipPts[j] = clipPos[model->vertIdx(faces[i], j)];
+            vertVaryings[j] = varyings[i][j];
+        }
+        if (shader->HasGeometry()) {
+            char* vertOutput = geometryVaryings.data();
+            for (int j = 0; j < 3; ++j) {
+                std::memcpy(vertOutput + j * varyingSize, vertVaryings[j], varyingSize);
+                vertVaryings[j] = vertOutput + j * varyingSize;
+            }
+            shader->Geometry(vertOutput);
+        }
+        rasterizer->Submit(clipPts, vertVaryings);
     }
-    // (ret.x + ret.y) / ret.z 先+后x 增加精度 避免在BC边上像素漏画
-    return vec3(1.f - (ret.x + ret.y) / ret.z, ret.x / ret.z, ret.y / ret.z);
 }
 
 void SoftRaster::GenerateImage() {
-     QImage image((uchar*)m_PixelBuffer, m_WindowWidth, m_WindowHeight, QImage::Format_ARGB32);
+     QImage image((uchar*)m_PixelBuffer->Data(), m_WindowWidth, m_WindowHeight, QImage::Format_ARGB32);
 
      // timer start
      LARGE_INTEGER cpuFreq;
@@ -442,36 +587,22 @@ void SoftRaster::GenerateImage() {
      QueryPerformanceFrequency(&cpuFreq);
      QueryPerformanceCounter(&startTime);
 
-     // clear image with black and clear depth buffer
-     QRgb bgColor = 255 << 24;
- #pragma omp parallel for
-     for (int i = 0; i < m_WindowHeight; ++i) {
-         for (int j = 0; j < m_WindowWidth; ++j) {
-             m_PixelBuffer[i * m_WindowWidth + j] = bgColor;
-             m_Zbuffer[i * m_WindowWidth + j] = Z_MIN;
-             m_Zbuffer1[i * m_WindowWidth + j] = Z_MIN;
-             m_ShadowMap[i * m_WindowWidth + j] = bgColor;
-             m_AOMap[i * m_WindowWidth + j] = bgColor;
-         }
-     }
-
-     SetViewMatrix(m_Camera->GetViewMatrix());
-     SetProjectionMatrix(m_Camera->GetProjectionMatrix());
-     SetRenderTargetResolution(m_WindowWidth, m_WindowHeight);
+     // clear image with black and clear depth buffer 不经过render graph 深度缓冲只在这里临时用一下
+     DepthBuffer zbuffer(m_WindowWidth, m_WindowHeight);
+     zbuffer.Clear(Z_MIN);
+     m_PixelBuffer->Clear(255 << 24);
+
      // 光栅化的步骤是为了插值ray 实际只有两个三角面片构成的长方形mesh
-     for (int i = 0; i < 2; ++i) {
-         vec4 clipPts[3];
-         for (int j = 0; j < 3; ++j) {
-             clipPts[j] = m_PathTracerShader->Vertex(i, j);
-         }
-         Triangle(clipPts, m_PathTracerShader, m_PixelBuffer, m_Zbuffer);
-     }
+     Rasterizer::RenderState quadState;
+     quadState.cullMode = Rasterizer::CULL_NONE;
+     Draw(0, 2, m_PathTracerShader, m_CameraUniforms, m_PixelBuffer, &zbuffer, quadState);
 
      // timer end
      QueryPerformanceCounter(&endTime);
      runtime = (((endTime.QuadPart - startTime.QuadPart) * 1000.0f) / cpuFreq.QuadPart);
      qDebug() << "runtime: " << runtime << "ms";
 
+     m_PixelBuffer->Resolve();
      image.save("./img/ray_tracer/result.png");
 }
 
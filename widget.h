@@ -20,6 +20,12 @@
 #include "monitor.h"
 #include "accel.h"
 #include "world.h"
+#include "depthbuffer.h"
+#include "colorbuffer.h"
+#include "rasterizer.h"
+#include "vertexcache.h"
+#include "rendergraph.h"
+#include "postprocess.h"
 
 class SoftRaster : public QWidget {
     Q_OBJECT
@@ -30,29 +36,54 @@ private:
     int m_WindowWidth = 600;    // px
     int m_WindowHeight = 600;   // px
 
-    QRgb* m_PixelBuffer = nullptr;  // 像素缓冲 color buffer
-    QRgb* m_ShadowMap = nullptr;    //
-    QRgb* m_AOMap = nullptr;
-    float* m_Zbuffer = nullptr;
-    float* m_Zbuffer1 = nullptr;
+    ColorBuffer* m_PixelBuffer = nullptr;  // 像素缓冲 color buffer 显示前要Resolve
+    DepthBuffer* m_ShadowMap = nullptr;     // 光源视角的float深度 跨帧保留 不由render graph分配
+    // 以下buffer由render graph分配 生存期不重叠时可能和其他transient buffer共用内存
+    ColorBuffer* m_AOMap = nullptr;
+    DepthBuffer* m_Zbuffer1 = nullptr;      // 相机的深度prepass 自带Hi-Z 多重采样时每个像素m_MSAASamples个深度
 
     int m_RepaintInterval = 100000;    // ms
     int m_RepaintTimer;
 
-    IShader* m_Shader = nullptr;
-    IShader* m_ShadowMapShader = nullptr;
-    IShader* m_HBAOShader = nullptr;
-    IShader* m_ZWriteShader = nullptr;
-    IShader* m_RayTracerShader = nullptr;
-    IShader* m_PathTracerShader = nullptr;
+    GeneralShader* m_Shader = nullptr;
+    ShadowMapShader* m_ShadowMapShader = nullptr;
+    HBAOPass* m_HBAOPass = nullptr;
+    MSAAResolvePass* m_MSAAResolvePass = nullptr;
+    BloomPass* m_BloomPass = nullptr;
+    ToneMapPass* m_ToneMapPass = nullptr;
+    FXAAPass* m_FXAAPass = nullptr;
+    ZWriteShader* m_ZWriteShader = nullptr;
+    RayTracerShader* m_RayTracerShader = nullptr;
+    PathTracerShader* m_PathTracerShader = nullptr;
 
     Light* m_PointLight = nullptr;
     Camera* m_Camera = nullptr;
+    ShaderUniforms m_CameraUniforms;        // 从相机看的pass用的uniform
+    ShaderUniforms m_LightUniforms;         // 从光源看的pass(shadow map)用的uniform
+
+    // shadow map只在光源的view/投影或投影物体的变换改变后重画
+    bool m_ShadowMapValid = false;
+    mat4x4 m_ShadowMapLightVP;              // 上次画shadow map时光源的vp矩阵
+    mat4x4 m_ShadowMapModel;                // 上次画shadow map时投影物体的model矩阵
 
     Accel* m_ModelAccel = nullptr;
 
+    RenderGraph* m_RenderGraph = nullptr;
+    std::vector<Rasterizer*> m_Rasterizers;     // 每个worker一个 同一波并行的pass各用各的
+    std::vector<VertexCache*> m_VertexCaches;   // 变换后的顶点 同一个worker上相同视角的pass共用
+    bool m_ShareDepthPrepass = true;    // 主pass直接用Pass 0的深度做EQUAL测试 不再自己写深度
+    int m_MSAASamples = Rasterizer::MSAA_SAMPLES;     // 相机视角的深度和主pass颜色的采样数 1为关闭MSAA
+
     Monitor* m_AnotherMonitor = nullptr;      // 用于查看其他buffer画面 如shadow map
 
+    void BuildRenderGraph();            // 声明各pass和它们读写的buffer 编译后取出buffer地址
+    Rasterizer::Stats GetStats() const;     // 所有worker的剔除统计之和
+    bool ShadowMapDirty() const;            // 缓存的shadow map是否需要重画
+
+    // DrawIndexed中顶点着色完一批后 提交这批三角形
+    template<class ShaderT>
+    void SubmitFaces(Rasterizer* rasterizer, const Model* model, ShaderT* shader, const vec4* clipPos, const int* faces, const void* const (*varyings)[3], int n);
+
 protected:
     virtual void paintEvent(QPaintEvent*) override;
     virtual void timerEvent(QTimerEvent* event) override;
@@ -62,8 +93,14 @@ public:
     ~SoftRaster();
 
     void Line(int x1, int y1, int x2, int y2, QRgb color);  // Bresenham’s Line Drawing Algorithm
-    void Triangle(vec4* clipPts, IShader* shader, QRgb* renderTarget, float* zbuffer);                   // 有深度测试 pts.xy是屏幕坐标 pts.z是深度
-    vec3 Barycentric(vec2* pts, vec2 p);                    // pts[0]=A pts[1]=B pts[2]=C p=P
+    // 按shader的具体类型实例化 光栅化器对Fragment的调用不走虚函数
+    // worker是render graph执行pass时给的序号 决定用哪一套光栅化器和顶点缓存 renderTarget为nullptr时只写深度
+    template<class ShaderT>
+    void Draw(int worker, int faceCount, ShaderT* shader, const ShaderUniforms& uniforms, ColorBuffer* renderTarget, DepthBuffer* zbuffer,
+              const Rasterizer::RenderState& state = Rasterizer::RenderState());    // 顶点着色后交给光栅化器分tile光栅化 有深度测试
+    template<class ShaderT>
+    void DrawIndexed(int worker, const Model* model, ShaderT* shader, const ShaderUniforms& uniforms, ColorBuffer* renderTarget, DepthBuffer* zbuffer,
+                     const Rasterizer::RenderState& state = Rasterizer::RenderState());     // 同Draw 但先剔除再按唯一顶点着色 clip坐标在相同视角的pass间复用
     void GenerateImage();                                   // 生成单张图片
 };
 